@@ -19,6 +19,19 @@ IoIn32:
     in eax, dx
     ret
 
+global IoOut8  ; void IoOut8(uint16_t addr, uint8_t data);
+IoOut8:
+    mov dx, di      ; dx = addr
+    mov al, sil     ; al = data
+    out dx, al
+    ret
+
+global IoIn8  ; uint8_t IoIn8(uint16_t addr);
+IoIn8:
+    mov dx, di      ; dx = addr
+    in al, dx
+    ret
+
 global LoadIDT  ; void LoadIDT(uint16_t limit, uint64_t offset);
 LoadIDT:
     push rbp
@@ -88,6 +101,58 @@ SetCR3:
     mov cr3, rdi
     ret
 
+global WriteBackInvalidateCache  ; void WriteBackInvalidateCache(void);
+WriteBackInvalidateCache:
+    wbinvd
+    ret
+
+global ReadCPUID ; void ReadCPUID(uint32_t eax, uint32_t ecx, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d);
+ReadCPUID:
+    push rbx        ; rbx is callee-saved
+    mov r10, rdx    ; r10 = a
+    mov r11, rcx    ; r11 = b
+    mov eax, edi    ; eax = leaf
+    mov ecx, esi    ; ecx = subleaf
+    cpuid
+    mov [r10], eax
+    mov [r11], ebx
+    mov [r8], ecx
+    mov [r9], edx
+    pop rbx
+    ret
+
+global GetXCR0  ; uint64_t GetXCR0(void);
+GetXCR0:
+    xor ecx, ecx    ; XCR0
+    xgetbv          ; edx:eax = XCR0
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global ReadTSC  ; uint64_t ReadTSC(void);
+ReadTSC:
+    rdtsc           ; edx:eax = TSC
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global ReadMSR  ; uint64_t ReadMSR(uint32_t msr);
+ReadMSR:
+    mov ecx, edi    ; ecx = msr
+    rdmsr           ; edx:eax = MSR[ecx]
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global WriteMSR  ; void WriteMSR(uint32_t msr, uint64_t value);
+WriteMSR:
+    mov ecx, edi    ; ecx = msr
+    mov eax, esi    ; eax = lower 32 bits of value
+    mov rdx, rsi
+    shr rdx, 32     ; edx = upper 32 bits of value
+    wrmsr
+    ret
+
 extern font_data
 extern kernel_main_stack
 extern KernelMainNewStack
@@ -3,6 +3,8 @@
 extern "C" {
     void IoOut32(uint16_t addr, uint32_t data);
     uint32_t IoIn32(uint16_t addr);
+    void IoOut8(uint16_t addr, uint8_t data);
+    uint8_t IoIn8(uint16_t addr);
     void LoadIDT(uint16_t limit, uint64_t offset);
     void LoadGDT(uint16_t limit, uint64_t offset);
     uint16_t GetCS(void);
@@ -11,4 +13,10 @@ extern "C" {
     void SetDSAll(uint16_t value);
     void SetCSSS(uint16_t cs, uint16_t ss);
     void SetCR3(uint64_t value);
+    void WriteBackInvalidateCache(void);
+    void ReadCPUID(uint32_t eax, uint32_t ecx, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d);
+    uint64_t GetXCR0(void);
+    uint64_t ReadTSC(void);
+    uint64_t ReadMSR(uint32_t msr);
+    void WriteMSR(uint32_t msr, uint64_t value);
 }
\ No newline at end of file
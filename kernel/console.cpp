@@ -6,7 +6,7 @@
 
 #include "console.hpp"
 
-#include <cstring>
+#include <algorithm>
 
 #include "font.hpp"
 #include "layer.hpp"
@@ -17,13 +17,24 @@ Console::Console(
       window_{},
       fg_color_{fg_color},
       bg_color_{bg_color},
-      buffer_{},
+      cells_{},
+      top_row_{0},
+      history_rows_{0},
+      view_offset_{0},
       cursor_row_{0},
       cursor_column_{0},
+      dirty_begin_{},
+      dirty_end_{},
+      pending_scroll_{0},
       layer_id_{0} {
+    for (auto& line : cells_) line.fill({'\0', fg_color_, bg_color_});
 }
 
 void Console::PutString(const char* s) {
+    if (view_offset_ > 0) {
+        view_offset_ = 0;
+        RedrawAll();
+    }
     while (*s) {
         if (*s == '\n') {
             Newline();
@@ -33,16 +44,18 @@ void Console::PutString(const char* s) {
                     Newline();
                     break;
                 }
-                buffer_[cursor_row_][cursor_column_++] = ' ';
+                CellAt(cursor_row_, cursor_column_) = {' ', fg_color_, bg_color_};
+                MarkDirty(cursor_row_, cursor_column_, cursor_column_ + 1);
+                ++cursor_column_;
             } while (cursor_column_ % KERNEL_TAB_WIDTH > 0);
         } else if (cursor_column_ < kColumns - 1) {
-            WriteAscii(*writer_, Vector2D<int>{KERNEL_GLYPH_WIDTH * cursor_column_, KERNEL_GLYPH_HEIGHT * cursor_row_}, *s, fg_color_);
-            buffer_[cursor_row_][cursor_column_] = *s;
+            CellAt(cursor_row_, cursor_column_) = {*s, fg_color_, bg_color_};
+            MarkDirty(cursor_row_, cursor_column_, cursor_column_ + 1);
             ++cursor_column_;
         }
         ++s;
     }
-    if (layer_manager) layer_manager->Draw(layer_id_);
+    if (!layer_manager || !layer_manager->IsDeferred()) Flush();
 }
 
 void Console::SetWriter(PixelWriter* writer) {
@@ -67,6 +80,84 @@ unsigned int Console::LayerID() const {
     return layer_id_;
 }
 
+void Console::Flush() {
+    if (!writer_) return;
+
+    if (pending_scroll_ > 0) {
+        if (window_ && pending_scroll_ < kRows) {
+            // 溜まった行数分だけ 1 度に画素を移動する 新しく現れた行は Newline で描き直し対象になっている
+            Rectangle<int> move_src{
+                {0, KERNEL_GLYPH_HEIGHT * pending_scroll_},
+                {KERNEL_GLYPH_WIDTH * kColumns, KERNEL_GLYPH_HEIGHT * (kRows - pending_scroll_)}};
+            window_->Move({0, 0}, move_src);
+        } else {
+            for (int row = 0; row < kRows; ++row) MarkDirty(row, 0, kColumns);
+        }
+    }
+
+    int dirty_row_begin = kRows, dirty_row_end = 0;
+    for (int row = 0; row < kRows; ++row) {
+        if (dirty_begin_[row] >= dirty_end_[row]) continue;
+        dirty_row_begin = std::min(dirty_row_begin, row);
+        dirty_row_end = row + 1;
+        DrawDirtyCells(row);
+    }
+
+    if (layer_manager && window_) {
+        if (pending_scroll_ > 0) {
+            layer_manager->Draw(layer_id_);
+        } else if (dirty_row_begin < dirty_row_end) {
+            layer_manager->Draw(layer_id_, {{0, KERNEL_GLYPH_HEIGHT * dirty_row_begin},
+                                            {KERNEL_GLYPH_WIDTH * kColumns,
+                                             KERNEL_GLYPH_HEIGHT * (dirty_row_end - dirty_row_begin)}});
+        }
+    }
+    pending_scroll_ = 0;
+}
+
+void Console::ScrollView(int lines) {
+    const int offset = std::clamp(view_offset_ + lines, 0, history_rows_);
+    if (offset == view_offset_) return;
+    view_offset_ = offset;
+    RedrawAll();
+    if (!layer_manager || !layer_manager->IsDeferred()) Flush();
+}
+
+Console::Cell& Console::CellAt(int row, int column) {
+    return cells_[(top_row_ + row) % kBufferRows][column];
+}
+
+const Console::Cell& Console::ViewCellAt(int row, int column) const {
+    return cells_[(top_row_ + kBufferRows - view_offset_ + row) % kBufferRows][column];
+}
+
+void Console::RedrawAll() {
+    // 溜まったスクロールが画面全体を超えたときと同じく，画素の移動をせず全体を描き直す
+    pending_scroll_ = kRows;
+}
+
+void Console::MarkDirty(int row, int begin, int end) {
+    if (dirty_begin_[row] >= dirty_end_[row]) {
+        dirty_begin_[row] = begin;
+        dirty_end_[row] = end;
+        return;
+    }
+    dirty_begin_[row] = std::min(dirty_begin_[row], begin);
+    dirty_end_[row] = std::max(dirty_end_[row], end);
+}
+
+void Console::DrawDirtyCells(int row) {
+    VisitPixelWriter(*writer_, [this, row](auto& w) {
+        for (int column = dirty_begin_[row]; column < dirty_end_[row]; ++column) {
+            const auto& cell = ViewCellAt(row, column);
+            const Vector2D<int> pos{KERNEL_GLYPH_WIDTH * column, KERNEL_GLYPH_HEIGHT * row};
+            detail::FillRectangle(w, pos, {KERNEL_GLYPH_WIDTH, KERNEL_GLYPH_HEIGHT}, cell.bg);
+            if (cell.ch != '\0' && cell.ch != ' ') detail::WriteAscii(w, pos, cell.ch, cell.fg);
+        }
+    });
+    dirty_begin_[row] = dirty_end_[row] = 0;
+}
+
 void Console::Newline() {
     cursor_column_ = 0;
     if (cursor_row_ < kRows - 1) {
@@ -74,33 +165,24 @@ void Console::Newline() {
         return;
     }
 
-    if (window_) {
-        Rectangle<int> move_src{
-            {0, KERNEL_GLYPH_HEIGHT},   // 1st row / 0th col
-            {KERNEL_GLYPH_WIDTH * kColumns, KERNEL_GLYPH_HEIGHT * (kRows - 1)}};    // (kRows - 1) rows / kColumns cols
-        window_->Move({0, 0}, move_src); // 0th row / 0th col
-        FillRectangle(*writer_,
-                      {0, KERNEL_GLYPH_HEIGHT * (kRows - 1)},   // (kRows - 1)th row / 0th col
-                      {KERNEL_GLYPH_WIDTH * kColumns, KERNEL_GLYPH_HEIGHT}, // 1 row / kColumns cols
-                      bg_color_);
-    } else {
-        FillRectangle(*writer_,
-                      {0, 0},
-                      {KERNEL_GLYPH_WIDTH * kColumns, KERNEL_GLYPH_HEIGHT * kRows},
-                      bg_color_);
-        for (int row = 0; row < kRows - 1; ++row) {
-            memcpy(buffer_[row], buffer_[row + 1], kColumns + 1);
-            WriteString(*writer_, Vector2D<int>{0, KERNEL_GLYPH_HEIGHT * row}, buffer_[row], fg_color_);
-        }
-        memset(buffer_[kRows - 1], 0, kColumns + 1);
+    // リングバッファの先頭をずらし，最も古い履歴行を新しい最終行として再利用する
+    top_row_ = (top_row_ + 1) % kBufferRows;
+    cells_[(top_row_ + kRows - 1) % kBufferRows].fill({'\0', fg_color_, bg_color_});
+    history_rows_ = std::min(history_rows_ + 1, kScrollbackRows);
+    ++pending_scroll_;
+
+    // 描き直しが必要な範囲も表示上の行と一緒に 1 行上へずらす
+    for (int row = 0; row < kRows - 1; ++row) {
+        dirty_begin_[row] = dirty_begin_[row + 1];
+        dirty_end_[row] = dirty_end_[row + 1];
     }
+    dirty_begin_[kRows - 1] = dirty_end_[kRows - 1] = 0;
+    MarkDirty(kRows - 1, 0, kColumns);
 }
 
 void Console::Refresh() {
-    FillRectangle(*writer_, {0, 0}, {KERNEL_GLYPH_WIDTH * kColumns, KERNEL_GLYPH_HEIGHT * kRows}, bg_color_);
-    for (int row = 0; row < kRows; ++row) {
-        WriteString(*writer_, {0, KERNEL_GLYPH_HEIGHT * row}, buffer_[row], fg_color_);
-    }
+    for (int row = 0; row < kRows; ++row) MarkDirty(row, 0, kColumns);
+    Flush();
 }
 
 Console* console;
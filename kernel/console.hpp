@@ -1,29 +1,78 @@
 #pragma once
 
+#include <array>
 #include <memory>
 #include "graphics.hpp"
 #include "window.hpp"
 
+/**
+ * @brief 文字セルの格子として内容を保持するコンソール
+ *
+ * PutString はセルの内容を更新して変更箇所を記録するだけで，
+ * 実際の描画は Flush でまとめて行う スクロールは行のリングバッファの先頭位置をずらすだけで，
+ * 画素の移動は Flush 時に溜まった行数分を 1 度だけ行う
+ */
 class Console {
   public:
     static const int kRows = 25, kColumns = 80;
+    /** @brief 画面外に保持しておく過去の行数 */
+    static const int kScrollbackRows = 200;
 
     Console(const PixelColor& fg_color, const PixelColor& bg_color);
+    /**
+     * @brief 文字列をコンソールに書き込む
+     *
+     * 遅延描画モードのレイヤーマネージャがあれば描画は次の Flush まで遅延される
+     */
     void PutString(const char* s);
     void SetWriter(PixelWriter* writer);
     void SetWindow(const std::shared_ptr<Window>& window);
     void SetLayerID(unsigned int id);
     unsigned int LayerID() const;
+    /** @brief 変更のあったセルだけを描画先に描き，レイヤーの再描画を要求する */
+    void Flush();
+    /**
+     * @brief 表示位置を履歴方向へ lines 行ずらす 負なら最新の出力方向へ戻す
+     * 次に PutString が呼ばれると表示位置は最新の出力に戻る
+     */
+    void ScrollView(int lines);
 
   private:
+    /** @brief 1 文字分のセル 文字と，その表示属性 (文字色・背景色) を持つ */
+    struct Cell {
+        char ch;
+        PixelColor fg, bg;
+    };
+
     void Newline();
     void Refresh();
+    /** @brief 最新の出力を表示した状態での row 行目 column 列目のセル */
+    Cell& CellAt(int row, int column);
+    /** @brief 現在の表示位置での row 行目 column 列目のセル */
+    const Cell& ViewCellAt(int row, int column) const;
+    /** @brief 次の Flush で画面全体を描き直すようにする */
+    void RedrawAll();
+    /** @brief 表示上の row 行目の [begin, end) 列を描き直しが必要な範囲に加える */
+    void MarkDirty(int row, int begin, int end);
+    /** @brief 表示上の row 行目の描き直しが必要な範囲を描く */
+    void DrawDirtyCells(int row);
 
     PixelWriter* writer_;
     std::shared_ptr<Window> window_;
     const PixelColor fg_color_, bg_color_;
-    char buffer_[kRows][kColumns + 1];
+    static const int kBufferRows = kRows + kScrollbackRows;
+    /** @brief 履歴を含む行のリングバッファ 最新の出力での 0 行目は cells_[top_row_] */
+    std::array<std::array<Cell, kColumns>, kBufferRows> cells_;
+    int top_row_;
+    /** @brief リングバッファに残っている画面外の過去の行数 */
+    int history_rows_;
+    /** @brief 表示位置を最新の出力から何行遡っているか */
+    int view_offset_;
     int cursor_row_, cursor_column_;
+    /** @brief 表示上の各行で描き直しが必要な列の範囲 [dirty_begin_, dirty_end_) 空なら begin >= end */
+    std::array<int, kRows> dirty_begin_, dirty_end_;
+    /** @brief 前回の Flush 以降に行ったスクロールの行数 */
+    int pending_scroll_;
     unsigned int layer_id_;
 };
 
@@ -31,24 +31,44 @@ const uint8_t* GetFont(char c) {
     return font_data[static_cast<unsigned int>(c)];
 }
 
-void WriteAscii(PixelWriter& writer, Vector2D<int> pos, char c, const PixelColor& color) {
-    const uint8_t* font = GetFont(c);
-    if (font == nullptr) {
-        return;
+namespace {
+    /**
+     * @brief グリフキャッシュ
+     *
+     * glyph_masks[c][dy][dx] は文字 c の (dx, dy) のピクセルを描くなら 0xffffffff，描かないなら 0
+     */
+    alignas(16) uint32_t glyph_masks[128][KERNEL_GLYPH_HEIGHT][KERNEL_GLYPH_WIDTH];
+}  // namespace
+
+void InitializeGlyphCache() {
+    for (int c = 0; c < 128; ++c) {
+        for (int dy = 0; dy < KERNEL_GLYPH_HEIGHT; ++dy) {
+            for (int dx = 0; dx < KERNEL_GLYPH_WIDTH; ++dx) {
+                const bool lit = (font_data[c][dy] >> dx) & 0x1u;
+                glyph_masks[c][dy][dx] = lit ? 0xffffffffu : 0;
+            }
+        }
     }
-    for (int dy = 0; dy < KERNEL_GLYPH_HEIGHT; ++dy) {
+}
+
+void DrawGlyph(uint32_t* dst, size_t stride, char c, uint32_t color) {
+    if (c < 0) return;
+    const auto index = static_cast<unsigned int>(c);
+    for (int dy = 0; dy < KERNEL_GLYPH_HEIGHT; ++dy, dst += stride) {
+        if (font_data[index][dy] == 0) continue;  // 何も描かない行
+        const uint32_t* mask = glyph_masks[index][dy];
         for (int dx = 0; dx < KERNEL_GLYPH_WIDTH; ++dx) {
-            if ((font[dy] >> dx) & 0x1u) {
-                writer.Write(pos + Vector2D<int>{dx, dy}, color);
-            }
+            dst[dx] = (dst[dx] & ~mask[dx]) | (color & mask[dx]);
         }
     }
 }
 
+void WriteAscii(PixelWriter& writer, Vector2D<int> pos, char c, const PixelColor& color) {
+    VisitPixelWriter(writer, [&](auto& w) { detail::WriteAscii(w, pos, c, color); });
+}
+
 // #@@range_begin(write_string)
 void WriteString(PixelWriter& writer, Vector2D<int> pos, const char* s, const PixelColor& color) {
-    for (int i = 0; s[i] != '\0'; ++i) {
-        WriteAscii(writer, pos + Vector2D<int>{KERNEL_GLYPH_WIDTH * i, 0}, s[i], color);
-    }
+    VisitPixelWriter(writer, [&](auto& w) { detail::WriteString(w, pos, s, color); });
 }
 // #@@range_end(write_string)
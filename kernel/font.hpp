@@ -7,5 +7,60 @@
 #define KERNEL_GLYPH_WIDTH  (8)
 #define KERNEL_TAB_WIDTH    (4)
 
+/** @brief 文字 c のフォントデータ (1 行 1 バイトのビットマップ) を返す 範囲外なら nullptr */
+const uint8_t* GetFont(char c);
+
+/**
+ * @brief フォントデータから，各グリフを 32 ビット/ピクセルのマスクに展開したキャッシュを作る
+ *
+ * フォントデータの読み込み後，DrawGlyph を使う前に 1 度呼ぶ
+ */
+void InitializeGlyphCache();
+
+/**
+ * @brief キャッシュ済みのグリフのマスクを使って，文字 c を 1 行ずつまとめて描く
+ *
+ * @param dst       グリフの左上に対応するピクセル
+ * @param stride    1 行あたりのピクセル数
+ * @param color     描画先のピクセル形式に変換済みの文字色
+ */
+void DrawGlyph(uint32_t* dst, size_t stride, char c, uint32_t color);
+
+namespace detail {
+    template <typename Writer>
+    void WriteAscii(Writer& writer, Vector2D<int> pos, char c, const PixelColor& color) {
+        const uint8_t* font = GetFont(c);
+        if (font == nullptr) {
+            return;
+        }
+        for (int dy = 0; dy < KERNEL_GLYPH_HEIGHT; ++dy) {
+            for (int dx = 0; dx < KERNEL_GLYPH_WIDTH; ++dx) {
+                if ((font[dy] >> dx) & 0x1u) {
+                    writer.Write(pos + Vector2D<int>{dx, dy}, color);
+                }
+            }
+        }
+    }
+
+    /** @brief グリフ全体が描画先に収まるならグリフキャッシュを使って描く */
+    template <PixelFormat F>
+    void WriteAscii(DirectPixelWriter<F>& writer, Vector2D<int> pos, char c, const PixelColor& color) {
+        const Rectangle<int> writer_area{{0, 0}, {writer.Width(), writer.Height()}};
+        const Rectangle<int> glyph_area{pos, {KERNEL_GLYPH_WIDTH, KERNEL_GLYPH_HEIGHT}};
+        if (!Contains(writer_area, glyph_area)) {
+            WriteAscii<DirectPixelWriter<F>>(writer, pos, c, color);
+            return;
+        }
+        DrawGlyph(writer.RowAt(pos.y) + pos.x, writer.Stride(), c, writer.Encode(color));
+    }
+
+    template <typename Writer>
+    void WriteString(Writer& writer, Vector2D<int> pos, const char* s, const PixelColor& color) {
+        for (int i = 0; s[i] != '\0'; ++i) {
+            WriteAscii(writer, pos + Vector2D<int>{KERNEL_GLYPH_WIDTH * i, 0}, s[i], color);
+        }
+    }
+}  // namespace detail
+
 void WriteAscii(PixelWriter& writer, Vector2D<int> pos, char c, const PixelColor& color);
 void WriteString(PixelWriter& writer, Vector2D<int> pos, const char* s, const PixelColor& color);
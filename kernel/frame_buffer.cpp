@@ -1,5 +1,9 @@
 #include "frame_buffer.hpp"
 
+#include <cstring>
+
+#include "raster.hpp"
+
 namespace {
     int BytesPerPixel(PixelFormat format) {
         switch (format) {
@@ -15,6 +19,11 @@ namespace {
             * (config.pixels_per_scan_line * pos.y + pos.x);
     }
 
+    uint32_t* PixelAddrAt(Vector2D<int> pos, const FrameBufferConfig& config) {
+        return reinterpret_cast<uint32_t*>(config.frame_buffer) +
+               config.pixels_per_scan_line * pos.y + pos.x;
+    }
+
     int BytesPerScanLine(const FrameBufferConfig& config){
         return BytesPerPixel(config.pixel_format) * config.pixels_per_scan_line;
     }
@@ -58,7 +67,9 @@ Error FrameBuffer::Initialize(const FrameBufferConfig& config){
     return MAKE_ERROR(Error::kSuccess);
 }
 
-Error FrameBuffer::Copy(Vector2D<int> dst_pos, const FrameBuffer& src, const Rectangle<int>& src_area){
+template <typename F>
+Error FrameBuffer::CopyRows(Vector2D<int> dst_pos, const FrameBuffer& src, const Rectangle<int>& src_area,
+                            F copy_span) {
     if(config_.pixel_format != src.config_.pixel_format){
         return MAKE_ERROR(Error::kUnknownPixelFormat);
     }
@@ -69,40 +80,76 @@ Error FrameBuffer::Copy(Vector2D<int> dst_pos, const FrameBuffer& src, const Rec
     const Rectangle<int> src_outline{dst_pos - src_area.pos, FrameBufferSize(src.config_)};
     const Rectangle<int> dst_outline{{0, 0}, FrameBufferSize(config_)};
     const auto copy_area = dst_outline & src_outline & src_area_shifted;
+    if (IsEmpty(copy_area)) return MAKE_ERROR(Error::kSuccess);
     const auto src_start_pos = copy_area.pos - (dst_pos - src_area.pos);
 
-    uint8_t* dst_buf = FrameAddrAt(copy_area.pos, config_);
-    const uint8_t* src_buf = FrameAddrAt(src_start_pos, src.config_);
+    uint32_t* dst_buf = PixelAddrAt(copy_area.pos, config_);
+    const uint32_t* src_buf = PixelAddrAt(src_start_pos, src.config_);
 
     for (int y = 0; y < copy_area.size.y;++y){
-        memcpy(dst_buf, src_buf, bytes_per_pixel * copy_area.size.x);
-        dst_buf += BytesPerScanLine(config_);
-        src_buf += BytesPerScanLine(src.config_);
+        copy_span(dst_buf, src_buf, copy_area.size.x);
+        dst_buf += config_.pixels_per_scan_line;
+        src_buf += src.config_.pixels_per_scan_line;
     }
     return MAKE_ERROR(Error::kSuccess);
 }
 
+Error FrameBuffer::Copy(Vector2D<int> dst_pos, const FrameBuffer& src, const Rectangle<int>& src_area){
+    return CopyRows(dst_pos, src, src_area, [](uint32_t* dst, const uint32_t* src, size_t count) {
+        CopySpan32(dst, src, count);
+    });
+}
+
+Error FrameBuffer::CopyColorKey(Vector2D<int> dst_pos, const FrameBuffer& src, const Rectangle<int>& src_area,
+                                const PixelColor& transparent_color) {
+    const auto key = ToNativePixel(src.config_.pixel_format, transparent_color);
+    return CopyRows(dst_pos, src, src_area, [key](uint32_t* dst, const uint32_t* src, size_t count) {
+        CopySpan32ColorKey(dst, src, count, key);
+    });
+}
+
 void FrameBuffer::Move(Vector2D<int> dst_pos, const Rectangle<int>& src) {
     const auto bytes_per_pixel = BytesPerPixel(config_.pixel_format);
-    const auto bytes_per_scan_line = BytesPerScanLine(config_);
+    const auto pixels_per_scan_line = config_.pixels_per_scan_line;
 
-    if(dst_pos.y < src.pos.y) {
+    if (dst_pos.y == src.pos.y) {
+        // 同じ行の中での移動は転送元と転送先が重なりうる
         uint8_t* dst_buf = FrameAddrAt(dst_pos, config_);
         const uint8_t* src_buf = FrameAddrAt(src.pos, config_);
+        for (int y = 0; y < src.size.y; ++y) {
+            memmove(dst_buf, src_buf, bytes_per_pixel * src.size.x);
+            dst_buf += BytesPerScanLine(config_);
+            src_buf += BytesPerScanLine(config_);
+        }
+    } else if(dst_pos.y < src.pos.y) {
+        uint32_t* dst_buf = PixelAddrAt(dst_pos, config_);
+        const uint32_t* src_buf = PixelAddrAt(src.pos, config_);
         for (int y = 0; y < src.size.y;++y){
-            memcpy(dst_buf, src_buf, bytes_per_pixel * src.size.x);
-            dst_buf += bytes_per_scan_line;
-            src_buf += bytes_per_scan_line;
+            CopySpan32(dst_buf, src_buf, src.size.x);
+            dst_buf += pixels_per_scan_line;
+            src_buf += pixels_per_scan_line;
         }
     }else{
-        uint8_t* dst_buf = FrameAddrAt(dst_pos + Vector2D<int>{0, src.size.y - 1}, config_);
-        const uint8_t* src_buf = FrameAddrAt(src.pos + Vector2D<int>{0, src.size.y - 1}, config_);
+        uint32_t* dst_buf = PixelAddrAt(dst_pos + Vector2D<int>{0, src.size.y - 1}, config_);
+        const uint32_t* src_buf = PixelAddrAt(src.pos + Vector2D<int>{0, src.size.y - 1}, config_);
         for (int y = 0; y < src.size.y; ++y) {
-            memcpy(dst_buf, src_buf, bytes_per_pixel * src.size.x);
-            dst_buf -= bytes_per_scan_line;
-            src_buf -= bytes_per_scan_line;
+            CopySpan32(dst_buf, src_buf, src.size.x);
+            dst_buf -= pixels_per_scan_line;
+            src_buf -= pixels_per_scan_line;
         }
     }
 }
 
+void FrameBuffer::FillRectangle(const Rectangle<int>& area, const PixelColor& c) {
+    const auto fill_area = area & Rectangle<int>{{0, 0}, FrameBufferSize(config_)};
+    if (IsEmpty(fill_area)) return;
+
+    const auto value = ToNativePixel(config_.pixel_format, c);
+    uint32_t* row = PixelAddrAt(fill_area.pos, config_);
+    for (int y = 0; y < fill_area.size.y; ++y) {
+        FillSpan32(row, value, fill_area.size.x);
+        row += config_.pixels_per_scan_line;
+    }
+}
+
 const FrameBufferConfig& FrameBuffer::Config() const { return config_; }
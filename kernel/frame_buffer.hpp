@@ -11,12 +11,22 @@ class FrameBuffer {
   public:
     Error Initialize(const FrameBufferConfig& config);
     Error Copy(Vector2D<int> dst_pos, const FrameBuffer& src, const Rectangle<int>& src_area);
+    /** @brief Copy と同様だが，src のうち色が transparent_color のピクセルはコピーしない */
+    Error CopyColorKey(Vector2D<int> dst_pos, const FrameBuffer& src, const Rectangle<int>& src_area,
+                       const PixelColor& transparent_color);
     void Move(Vector2D<int> dst_pos, const Rectangle<int>& src);
+    /** @brief 指定した矩形領域を 1 色で塗りつぶす バッファからはみ出す部分は無視される */
+    void FillRectangle(const Rectangle<int>& area, const PixelColor& c);
     const FrameBufferConfig& Config() const;
 
     FrameBufferWriter& Writer() { return *writer_; }
 
   private:
+    /** @brief src から dst_pos へコピーできる範囲を求め，行ごとに copy_span を呼ぶ */
+    template <typename F>
+    Error CopyRows(Vector2D<int> dst_pos, const FrameBuffer& src, const Rectangle<int>& src_area,
+                   F copy_span);
+
     FrameBufferConfig config_{};
     std::vector<uint8_t> buffer_{};
     std::unique_ptr<FrameBufferWriter> writer_{};
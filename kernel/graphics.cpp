@@ -4,53 +4,28 @@
  * 画像描画関連のプログラムを集めたファイル．
  */
 
-// #@@range_begin(pixel_writer_impl)
 #include "graphics.hpp"
 
-void RGBResv8BitPerColorPixelWriter::Write(Vector2D<int> pos, const PixelColor& c) {
-    auto p = PixelAt(pos);
-    p[0] = c.r;
-    p[1] = c.g;
-    p[2] = c.b;
-}
-// #@@range_end(pixel_writer_impl)
-
-void BGRResv8BitPerColorPixelWriter::Write(Vector2D<int> pos, const PixelColor& c) {
-    auto p = PixelAt(pos);
-    p[0] = c.b;
-    p[1] = c.g;
-    p[2] = c.r;
-}
-
 void DrawRectangle(PixelWriter& writer, const Vector2D<int>& pos,
                    const Vector2D<int>& size, const PixelColor& c) {
-    for (int dx = 0; dx < size.x; ++dx) {  // vertical lines
-        writer.Write(pos + Vector2D<int>{dx, 0}, c);
-        writer.Write(pos + Vector2D<int>{dx, size.y - 1}, c);
-    }
-    for (int dy = 1; dy < size.y - 1; ++dy) {
-        writer.Write(pos + Vector2D<int>{0, dy}, c);
-        writer.Write(pos + Vector2D<int>{size.x - 1, dy}, c);
-    }
+    VisitPixelWriter(writer, [&](auto& w) { detail::DrawRectangle(w, pos, size, c); });
 }
 
 void FillRectangle(PixelWriter& writer, const Vector2D<int>& pos,
                    const Vector2D<int>& size, const PixelColor& c) {
-    for (int dy = 0; dy < size.y; ++dy) {
-        for (int dx = 0; dx < size.x; ++dx) {
-            writer.Write(pos + Vector2D<int>{dx, dy}, c);
-        }
-    }
+    VisitPixelWriter(writer, [&](auto& w) { detail::FillRectangle(w, pos, size, c); });
 }
 
 void DrawDesktop(PixelWriter& writer) {
-    const auto width = writer.Width();
-    const auto height = writer.Height();
-
-    FillRectangle(writer, {0, 0}, {width, height - 50}, kDesktopBGColor);
-    FillRectangle(writer, {0, height - 50}, {width, 50}, {1, 8, 17});
-    FillRectangle(writer, {0, height - 50}, {width / 5, 50}, {80, 80, 80});
-    DrawRectangle(writer, {10, height - 40}, {30, 30}, {160, 160, 160});
+    VisitPixelWriter(writer, [](auto& w) {
+        const auto width = w.Width();
+        const auto height = w.Height();
+
+        detail::FillRectangle(w, {0, 0}, {width, height - 50}, kDesktopBGColor);
+        detail::FillRectangle(w, {0, height - 50}, {width, 50}, {1, 8, 17});
+        detail::FillRectangle(w, {0, height - 50}, {width / 5, 50}, {80, 80, 80});
+        detail::DrawRectangle(w, {10, height - 40}, {30, 30}, {160, 160, 160});
+    });
 }
 
 FrameBufferConfig screen_config;
@@ -67,13 +42,14 @@ namespace {
 
 void InitializeGraphics(const FrameBufferConfig& screen_config) {
     ::screen_config = screen_config;
+    InitializeRaster();
 
     switch (screen_config.pixel_format) {
         case kPixelRGBResv8BitPerColor:
-            ::screen_writer = new (pixel_writer_buf) RGBResv8BitPerColorPixelWriter{screen_config};
+            ::screen_writer = new (pixel_writer_buf) RGBResv8BitPerColorPixelWriter{::screen_config};
             break;
         case kPixelBGRResv8BitPerColor:
-            ::screen_writer = new (pixel_writer_buf) BGRResv8BitPerColorPixelWriter{screen_config};
+            ::screen_writer = new (pixel_writer_buf) BGRResv8BitPerColorPixelWriter{::screen_config};
             break;
         default:
             exit(1);
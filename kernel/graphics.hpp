@@ -3,6 +3,7 @@
 #include <algorithm>
 
 #include "frame_buffer_config.hpp"
+#include "raster.hpp"
 
 struct PixelColor {
     uint8_t r, g, b;
@@ -15,6 +16,56 @@ inline bool operator!=(const PixelColor& lhs, const PixelColor& rhs) {
     return !(lhs == rhs);
 }
 
+/**
+ * @brief ピクセル形式ごとの 32 ビット値と色との変換規則
+ *
+ * Encode は予約バイトを 0 とする
+ */
+template <PixelFormat F>
+struct PixelTraits;
+
+template <>
+struct PixelTraits<kPixelRGBResv8BitPerColor> {
+    static constexpr uint32_t Encode(const PixelColor& c) {
+        return c.r | (c.g << 8) | (c.b << 16);
+    }
+    static constexpr PixelColor Decode(uint32_t v) {
+        return {static_cast<uint8_t>(v), static_cast<uint8_t>(v >> 8), static_cast<uint8_t>(v >> 16)};
+    }
+};
+
+template <>
+struct PixelTraits<kPixelBGRResv8BitPerColor> {
+    static constexpr uint32_t Encode(const PixelColor& c) {
+        return c.b | (c.g << 8) | (c.r << 16);
+    }
+    static constexpr PixelColor Decode(uint32_t v) {
+        return {static_cast<uint8_t>(v >> 16), static_cast<uint8_t>(v >> 8), static_cast<uint8_t>(v)};
+    }
+};
+
+/** @brief 色を指定したピクセル形式の 32 ビット値に変換する 予約バイトは 0 とする */
+inline uint32_t ToNativePixel(PixelFormat format, const PixelColor& c) {
+    switch (format) {
+        case kPixelRGBResv8BitPerColor:
+            return PixelTraits<kPixelRGBResv8BitPerColor>::Encode(c);
+        case kPixelBGRResv8BitPerColor:
+            return PixelTraits<kPixelBGRResv8BitPerColor>::Encode(c);
+    }
+    return 0;
+}
+
+/** @brief 指定したピクセル形式の 32 ビット値を色に変換する */
+inline PixelColor FromNativePixel(PixelFormat format, uint32_t v) {
+    switch (format) {
+        case kPixelRGBResv8BitPerColor:
+            return PixelTraits<kPixelRGBResv8BitPerColor>::Decode(v);
+        case kPixelBGRResv8BitPerColor:
+            return PixelTraits<kPixelBGRResv8BitPerColor>::Decode(v);
+    }
+    return {0, 0, 0};
+}
+
 template <typename T>
 struct Vector2D {
     T x, y;
@@ -89,12 +140,49 @@ Rectangle<T> operator&(const Rectangle<T>& lhs, const Rectangle<U>& rhs) {
     return {pos, size};
 }
 
+/** @brief 矩形が面積を持たないなら true */
+template <typename T>
+bool IsEmpty(const Rectangle<T>& rect) {
+    return rect.size.x <= 0 || rect.size.y <= 0;
+}
+
+/** @brief 矩形の面積を返す 面積を持たない場合は 0 */
+template <typename T>
+T Area(const Rectangle<T>& rect) {
+    return IsEmpty(rect) ? 0 : rect.size.x * rect.size.y;
+}
+
+/** @brief inner が outer に完全に含まれるなら true */
+template <typename T, typename U>
+bool Contains(const Rectangle<T>& outer, const Rectangle<U>& inner) {
+    const auto outer_end = outer.pos + outer.size;
+    const auto inner_end = inner.pos + inner.size;
+    return outer.pos.x <= inner.pos.x && outer.pos.y <= inner.pos.y &&
+           inner_end.x <= outer_end.x && inner_end.y <= outer_end.y;
+}
+
+/** @brief 2 つの矩形を両方とも含む最小の矩形を返す */
+template <typename T, typename U>
+Rectangle<T> operator|(const Rectangle<T>& lhs, const Rectangle<U>& rhs) {
+    if (IsEmpty(lhs)) return {rhs.pos, rhs.size};
+    if (IsEmpty(rhs)) return lhs;
+    const auto pos = ElementMin(lhs.pos, rhs.pos);
+    const auto end = ElementMax(lhs.pos + lhs.size, rhs.pos + rhs.size);
+    return {pos, end - pos};
+}
+
 class PixelWriter {
   public:
     virtual ~PixelWriter() = default;
     virtual void Write(Vector2D<int> pos, const PixelColor& c) = 0;
     virtual int Width() const = 0;
     virtual int Height() const = 0;
+    /**
+     * @brief 描画先がメモリ上の 32 ビット/ピクセルの配列ならその設定を返す
+     *
+     * nullptr でなければ，描画関数は Write を経由せず直接書き込んでよい
+     */
+    virtual const FrameBufferConfig* DirectConfig() const { return nullptr; }
 };
 
 class FrameBufferWriter : public PixelWriter {
@@ -103,30 +191,129 @@ class FrameBufferWriter : public PixelWriter {
     virtual ~FrameBufferWriter() = default;
     virtual int Width() const override { return config_.horizontal_resolution; }
     virtual int Height() const override { return config_.vertical_resolution; }
+    virtual const FrameBufferConfig* DirectConfig() const override { return &config_; }
 
   protected:
-    uint8_t* PixelAt(Vector2D<int> pos) {
-        const int PIXEL_SIZE = 4;  // RGBResv 8-bit color -> 32 bits
-        return config_.frame_buffer + PIXEL_SIZE * (config_.pixels_per_scan_line * pos.y + pos.x);
+    uint32_t* PixelAt(Vector2D<int> pos) {
+        return reinterpret_cast<uint32_t*>(config_.frame_buffer) + config_.pixels_per_scan_line * pos.y + pos.x;
     }
 
   private:
-    const FrameBufferConfig& config_;
+    // 呼び出し元の設定の寿命に依存しないよう，参照ではなく複製を保持する
+    const FrameBufferConfig config_;
 };
 
 // #@@range_begin(pixel_writer_def)
-class RGBResv8BitPerColorPixelWriter : public FrameBufferWriter {
+/** @brief ピクセル形式 F のフレームバッファに書き込む PixelWriter */
+template <PixelFormat F>
+class FormatPixelWriter : public FrameBufferWriter {
   public:
     using FrameBufferWriter::FrameBufferWriter;
-    virtual void Write(Vector2D<int> pos, const PixelColor& c) override;
+    virtual void Write(Vector2D<int> pos, const PixelColor& c) override {
+        *PixelAt(pos) = PixelTraits<F>::Encode(c);
+    }
 };
 
-class BGRResv8BitPerColorPixelWriter : public FrameBufferWriter {
+using RGBResv8BitPerColorPixelWriter = FormatPixelWriter<kPixelRGBResv8BitPerColor>;
+using BGRResv8BitPerColorPixelWriter = FormatPixelWriter<kPixelBGRResv8BitPerColor>;
+// #@@range_end(pixel_writer_def)
+
+/**
+ * @brief ピクセル形式をコンパイル時に固定した，仮想関数を使わない書き込み器
+ *
+ * PixelWriter と同じ Write / Width / Height を持つので，描画関数のテンプレートに
+ * どちらも渡すことができる 行の先頭アドレスは RowAt で得られる
+ */
+template <PixelFormat F>
+class DirectPixelWriter {
   public:
-    using FrameBufferWriter::FrameBufferWriter;
-    virtual void Write(Vector2D<int> pos, const PixelColor& c) override;
+    explicit DirectPixelWriter(const FrameBufferConfig& config)
+        : base_{reinterpret_cast<uint32_t*>(config.frame_buffer)},
+          stride_{config.pixels_per_scan_line},
+          width_{static_cast<int>(config.horizontal_resolution)},
+          height_{static_cast<int>(config.vertical_resolution)} {}
+
+    static constexpr uint32_t Encode(const PixelColor& c) { return PixelTraits<F>::Encode(c); }
+
+    void Write(Vector2D<int> pos, const PixelColor& c) { RowAt(pos.y)[pos.x] = Encode(c); }
+    int Width() const { return width_; }
+    int Height() const { return height_; }
+    uint32_t* RowAt(int y) const { return base_ + stride_ * y; }
+    size_t Stride() const { return stride_; }
+
+  private:
+    uint32_t* base_;
+    size_t stride_;
+    int width_, height_;
 };
-// #@@range_end(pixel_writer_def)
+
+/**
+ * @brief writer をピクセル形式ごとの DirectPixelWriter に変換して f を呼ぶ
+ *
+ * 直接書き込めない writer の場合は writer 自身を渡す
+ * 描画関数の先頭で 1 度だけ呼べば，以降のピクセル単位の処理で仮想関数呼び出しが生じない
+ */
+template <typename F>
+void VisitPixelWriter(PixelWriter& writer, F&& f) {
+    if (auto config = writer.DirectConfig()) {
+        switch (config->pixel_format) {
+            case kPixelRGBResv8BitPerColor: {
+                DirectPixelWriter<kPixelRGBResv8BitPerColor> direct{*config};
+                f(direct);
+                return;
+            }
+            case kPixelBGRResv8BitPerColor: {
+                DirectPixelWriter<kPixelBGRResv8BitPerColor> direct{*config};
+                f(direct);
+                return;
+            }
+        }
+    }
+    f(writer);
+}
+
+/**
+ * 描画関数のテンプレート版
+ * 書き込み器の型ごとに実体化されるので，DirectPixelWriter を渡せば仮想関数呼び出しが生じない
+ */
+namespace detail {
+    template <typename Writer>
+    void FillRectangle(Writer& writer, const Vector2D<int>& pos,
+                       const Vector2D<int>& size, const PixelColor& c) {
+        for (int dy = 0; dy < size.y; ++dy) {
+            for (int dx = 0; dx < size.x; ++dx) {
+                writer.Write(pos + Vector2D<int>{dx, dy}, c);
+            }
+        }
+    }
+
+    /** @brief 行ごとに 32 ビット単位でまとめて埋める 書き込み先からはみ出す部分は無視される */
+    template <PixelFormat F>
+    void FillRectangle(DirectPixelWriter<F>& writer, const Vector2D<int>& pos,
+                       const Vector2D<int>& size, const PixelColor& c) {
+        const Rectangle<int> writer_area{{0, 0}, {writer.Width(), writer.Height()}};
+        const auto area = Rectangle<int>{pos, size} & writer_area;
+        if (IsEmpty(area)) return;
+
+        const auto value = writer.Encode(c);
+        for (int y = area.pos.y; y < area.pos.y + area.size.y; ++y) {
+            FillSpan32(writer.RowAt(y) + area.pos.x, value, area.size.x);
+        }
+    }
+
+    template <typename Writer>
+    void DrawRectangle(Writer& writer, const Vector2D<int>& pos,
+                       const Vector2D<int>& size, const PixelColor& c) {
+        for (int dx = 0; dx < size.x; ++dx) {  // vertical lines
+            writer.Write(pos + Vector2D<int>{dx, 0}, c);
+            writer.Write(pos + Vector2D<int>{dx, size.y - 1}, c);
+        }
+        for (int dy = 1; dy < size.y - 1; ++dy) {
+            writer.Write(pos + Vector2D<int>{0, dy}, c);
+            writer.Write(pos + Vector2D<int>{size.x - 1, dy}, c);
+        }
+    }
+}  // namespace detail
 
 void FillRectangle(PixelWriter& writer, const Vector2D<int>& pos,
                    const Vector2D<int>& size, const PixelColor& c);
@@ -0,0 +1,338 @@
+/**
+ * @file heap.cpp
+ *
+ * カーネルヒープ (malloc/free) の実装
+ */
+
+#include "heap.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include "interrupt.hpp"
+#include "memory_manager.hpp"
+#include "spinlock.hpp"
+
+namespace {
+    /**
+     * @brief 区分ごとのオブジェクトの大きさ
+     * どれも 16 の倍数なので，スラブ内のオブジェクトは 16 バイト境界に並ぶ
+     * 大きい区分は 1 フレームのスラブに詰められる最大の大きさにしてある
+     */
+    const std::array<size_t, kHeapSizeClassCount> kClassSizes{
+        16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 672, 1008, 2016};
+
+    const uint32_t kSlabMagic = 0x534c4142;   // "SLAB"
+    const uint32_t kLargeMagic = 0x4c415247;  // "LARG"
+
+    /** @brief スラブ (1 フレーム) の先頭に置く管理情報 オブジェクトはこの後ろに並ぶ */
+    struct alignas(64) Slab {
+        Slab* prev;
+        Slab* next;
+        /** @brief 空きオブジェクトの単方向リスト 各オブジェクトの先頭に次のオブジェクトへのポインタを置く */
+        void* free_list;
+        uint32_t magic;
+        uint16_t in_use;
+        uint16_t size_class;
+    };
+    static_assert(sizeof(Slab) == 64);
+    const size_t kSlabHeaderBytes = sizeof(Slab);
+
+    /** @brief フレームから直接確保した大きなオブジェクトの管理情報 オブジェクトの直前の 64 バイトに置く */
+    struct alignas(64) LargeHeader {
+        uint32_t magic;
+        size_t start_frame;
+        size_t num_frames;
+    };
+    static_assert(sizeof(LargeHeader) == 64);
+
+    /** @brief 区分ごとのスラブの一覧 */
+    struct SizeClass {
+        /** @brief 空きのあるスラブのリスト */
+        Slab* partial;
+        /** @brief 完全に空になったスラブを 1 つだけ手元に残しておく */
+        Slab* spare;
+        size_t objects_in_use;
+        size_t slabs;
+    };
+
+    std::array<SizeClass, kHeapSizeClassCount> size_classes;
+    size_t large_objects, large_frames;
+    /** @brief ヒープ全体を CPU 間で排他するロック 割り込みを禁止してから取る */
+    SpinLock heap_lock;
+
+    int SizeClassOf(size_t size) {
+        for (size_t i = 0; i < kClassSizes.size(); ++i) {
+            if (size <= kClassSizes[i]) return i;
+        }
+        return -1;
+    }
+
+    void PushSlab(Slab*& list, Slab* slab) {
+        slab->prev = nullptr;
+        slab->next = list;
+        if (list) list->prev = slab;
+        list = slab;
+    }
+
+    void RemoveSlab(Slab*& list, Slab* slab) {
+        if (slab->prev) {
+            slab->prev->next = slab->next;
+        } else {
+            list = slab->next;
+        }
+        if (slab->next) slab->next->prev = slab->prev;
+    }
+
+    Slab* NewSlab(int size_class) {
+        auto [frame, err] = AllocateFrames(1);
+        if (err) return nullptr;
+
+        auto slab = reinterpret_cast<Slab*>(frame.Frame());
+        slab->magic = kSlabMagic;
+        slab->in_use = 0;
+        slab->size_class = size_class;
+        slab->free_list = nullptr;
+
+        // 後ろのオブジェクトから積んでいき，前のオブジェクトから使われるようにする
+        const auto size = kClassSizes[size_class];
+        const auto base = reinterpret_cast<uintptr_t>(slab) + kSlabHeaderBytes;
+        const auto count = (kBytesPerFrame - kSlabHeaderBytes) / size;
+        for (size_t i = count; i > 0; --i) {
+            auto obj = reinterpret_cast<void**>(base + (i - 1) * size);
+            *obj = slab->free_list;
+            slab->free_list = obj;
+        }
+        ++size_classes[size_class].slabs;
+        return slab;
+    }
+
+    void* AllocateSmall(int size_class) {
+        auto& sc = size_classes[size_class];
+        if (sc.partial == nullptr) {
+            auto slab = sc.spare ? sc.spare : NewSlab(size_class);
+            if (slab == nullptr) return nullptr;
+            sc.spare = nullptr;
+            PushSlab(sc.partial, slab);
+        }
+
+        auto slab = sc.partial;
+        auto obj = reinterpret_cast<void**>(slab->free_list);
+        slab->free_list = *obj;
+        ++slab->in_use;
+        ++sc.objects_in_use;
+        if (slab->free_list == nullptr) RemoveSlab(sc.partial, slab);  // 満杯のスラブはリストから外す
+        return obj;
+    }
+
+    void FreeSmall(Slab* slab, void* ptr) {
+        auto& sc = size_classes[slab->size_class];
+        if (slab->free_list == nullptr) PushSlab(sc.partial, slab);  // 満杯だったスラブに空きができた
+
+        auto obj = reinterpret_cast<void**>(ptr);
+        *obj = slab->free_list;
+        slab->free_list = obj;
+        --slab->in_use;
+        --sc.objects_in_use;
+        if (slab->in_use > 0) return;
+
+        // 空になったスラブは 1 つだけ残し，それ以外はフレームを返す
+        RemoveSlab(sc.partial, slab);
+        if (sc.spare == nullptr) {
+            sc.spare = slab;
+            return;
+        }
+        slab->magic = 0;
+        --sc.slabs;
+        FreeFrames(FrameID{reinterpret_cast<uintptr_t>(slab) / kBytesPerFrame}, 1);
+    }
+
+    /**
+     * @brief フレームから直接確保する
+     * 管理情報をオブジェクトの直前に置く alignment がフレームより小さいときは管理情報とオブジェクトは同じフレームに，
+     * フレーム以上のときはオブジェクトがフレームの先頭に来るので管理情報は直前のフレームに入る
+     */
+    void* AllocateLarge(size_t size, size_t alignment) {
+        if (size > SIZE_MAX / 2) return nullptr;
+        const size_t offset = alignment < sizeof(LargeHeader) ? sizeof(LargeHeader) : alignment;
+        // バディアロケータは 2 の冪に切り上げた大きさに整列した領域を返す フレーム数は offset / kBytesPerFrame を
+        // 超えるので，フレーム以上の alignment も領域の先頭から offset の位置で満たせる
+        const size_t num_frames = (offset + size + kBytesPerFrame - 1) / kBytesPerFrame;
+        auto [frame, err] = AllocateFrames(num_frames);
+        if (err) return nullptr;
+
+        // 先頭フレームがスラブと誤認されないようにする
+        if (offset < kBytesPerFrame) reinterpret_cast<Slab*>(frame.Frame())->magic = 0;
+
+        const auto ptr = reinterpret_cast<uintptr_t>(frame.Frame()) + offset;
+        auto header = reinterpret_cast<LargeHeader*>(ptr - sizeof(LargeHeader));
+        header->magic = kLargeMagic;
+        header->start_frame = frame.ID();
+        header->num_frames = num_frames;
+        ++large_objects;
+        large_frames += num_frames;
+        return reinterpret_cast<void*>(ptr);
+    }
+
+    void FreeLarge(LargeHeader* header) {
+        header->magic = 0;
+        --large_objects;
+        large_frames -= header->num_frames;
+        FreeFrames(FrameID{header->start_frame}, header->num_frames);
+    }
+
+    /**
+     * @brief ptr の管理情報を探す
+     * スラブのオブジェクトも大きなオブジェクトも，フレームの先頭から 64 バイト未満には置かれない
+     * フレームの先頭にあるのはフレーム以上に整列した大きなオブジェクトだけで，その管理情報は直前にある
+     */
+    void FindHeader(void* ptr, Slab** slab, LargeHeader** large) {
+        *slab = nullptr;
+        *large = nullptr;
+        const auto addr = reinterpret_cast<uintptr_t>(ptr);
+        if (addr % kBytesPerFrame == 0) {
+            *large = reinterpret_cast<LargeHeader*>(addr - sizeof(LargeHeader));
+            return;
+        }
+        const auto frame_start = addr - addr % kBytesPerFrame;
+        if (reinterpret_cast<Slab*>(frame_start)->magic == kSlabMagic) {
+            *slab = reinterpret_cast<Slab*>(frame_start);
+        } else {
+            *large = reinterpret_cast<LargeHeader*>(addr - sizeof(LargeHeader));
+        }
+    }
+
+    void* Allocate(size_t size, size_t alignment) {
+        InterruptGuard interrupt_guard;
+        SpinLockGuard lock{heap_lock};
+        const auto size_class = SizeClassOf(size);
+        // スラブのオブジェクトは 16 バイト境界にしか並ばない
+        if (size_class >= 0 && alignment <= 16) return AllocateSmall(size_class);
+        return AllocateLarge(size, alignment);
+    }
+
+    void Free(void* ptr) {
+        if (ptr == nullptr) return;
+        InterruptGuard interrupt_guard;
+        SpinLockGuard lock{heap_lock};
+        Slab* slab;
+        LargeHeader* large;
+        FindHeader(ptr, &slab, &large);
+        if (slab) {
+            FreeSmall(slab, ptr);
+        } else if (large->magic == kLargeMagic) {
+            FreeLarge(large);
+        }
+    }
+
+    /** @brief ptr の領域のうち使ってよいバイト数 */
+    size_t UsableSize(void* ptr) {
+        Slab* slab;
+        LargeHeader* large;
+        FindHeader(ptr, &slab, &large);
+        if (slab) return kClassSizes[slab->size_class];
+        const auto end = (large->start_frame + large->num_frames) * kBytesPerFrame;
+        return end - reinterpret_cast<uintptr_t>(ptr);
+    }
+
+    void* Reallocate(void* ptr, size_t size) {
+        if (ptr == nullptr) return Allocate(size, 16);
+        if (size == 0) {
+            Free(ptr);
+            return nullptr;
+        }
+        const auto usable = UsableSize(ptr);
+        if (size <= usable) return ptr;
+        auto new_ptr = Allocate(size, 16);
+        if (new_ptr == nullptr) return nullptr;
+        memcpy(new_ptr, ptr, usable);
+        Free(ptr);
+        return new_ptr;
+    }
+
+    bool IsPowerOfTwo(size_t n) {
+        return n != 0 && (n & (n - 1)) == 0;
+    }
+}  // namespace
+
+HeapStats GetHeapStats() {
+    InterruptGuard interrupt_guard;
+    SpinLockGuard lock{heap_lock};
+    HeapStats stats{};
+    for (size_t i = 0; i < kHeapSizeClassCount; ++i) {
+        stats.class_size[i] = kClassSizes[i];
+        stats.objects_in_use[i] = size_classes[i].objects_in_use;
+        stats.slabs[i] = size_classes[i].slabs;
+        stats.total_frames += size_classes[i].slabs;
+    }
+    stats.large_objects = large_objects;
+    stats.large_frames = large_frames;
+    stats.total_frames += large_frames;
+    return stats;
+}
+
+// newlib の malloc 一式を置き換える リエントラント版 (_r) も定義して newlib の実装がリンクされないようにする
+extern "C" {
+    void* malloc(size_t size) {
+        auto ptr = Allocate(size, 16);
+        if (ptr == nullptr) errno = ENOMEM;
+        return ptr;
+    }
+
+    void free(void* ptr) {
+        Free(ptr);
+    }
+
+    void* calloc(size_t num, size_t size) {
+        if (size != 0 && num > SIZE_MAX / size) {
+            errno = ENOMEM;
+            return nullptr;
+        }
+        auto ptr = malloc(num * size);
+        if (ptr) memset(ptr, 0, num * size);
+        return ptr;
+    }
+
+    void* realloc(void* ptr, size_t size) {
+        auto new_ptr = Reallocate(ptr, size);
+        if (new_ptr == nullptr && size != 0) errno = ENOMEM;
+        return new_ptr;
+    }
+
+    int posix_memalign(void** memptr, size_t alignment, size_t size) {
+        if (!IsPowerOfTwo(alignment) || alignment % sizeof(void*) != 0) return EINVAL;
+        auto ptr = Allocate(size, alignment);
+        if (ptr == nullptr) return ENOMEM;
+        *memptr = ptr;
+        return 0;
+    }
+
+    void* memalign(size_t alignment, size_t size) {
+        if (!IsPowerOfTwo(alignment)) {
+            errno = EINVAL;
+            return nullptr;
+        }
+        auto ptr = Allocate(size, alignment);
+        if (ptr == nullptr) errno = ENOMEM;
+        return ptr;
+    }
+
+    void* aligned_alloc(size_t alignment, size_t size) {
+        return memalign(alignment, size);
+    }
+
+    size_t malloc_usable_size(void* ptr) {
+        if (ptr == nullptr) return 0;
+        InterruptGuard interrupt_guard;
+        SpinLockGuard lock{heap_lock};
+        return UsableSize(ptr);
+    }
+
+    void* _malloc_r(struct _reent*, size_t size) { return malloc(size); }
+    void _free_r(struct _reent*, void* ptr) { free(ptr); }
+    void* _calloc_r(struct _reent*, size_t num, size_t size) { return calloc(num, size); }
+    void* _realloc_r(struct _reent*, void* ptr, size_t size) { return realloc(ptr, size); }
+    void* _memalign_r(struct _reent*, size_t alignment, size_t size) { return memalign(alignment, size); }
+    size_t _malloc_usable_size_r(struct _reent*, void* ptr) { return malloc_usable_size(ptr); }
+}
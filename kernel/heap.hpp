@@ -0,0 +1,28 @@
+/**
+ * @file heap.hpp
+ *
+ * カーネルヒープ (malloc/free) の実装
+ *
+ * 2016 バイト以下の要求は大きさの区分ごとのスラブから，それより大きい要求は物理フレームから直接確保する
+ * スラブもフレームも必要になったときに AllocateFrames で確保する
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+
+/** @brief スラブで扱う大きさの区分の数 */
+const size_t kHeapSizeClassCount = 13;
+
+struct HeapStats {
+    /** @brief 区分ごとの，割り当て中のオブジェクト数とスラブ数 */
+    std::array<size_t, kHeapSizeClassCount> class_size, objects_in_use, slabs;
+    /** @brief フレームから直接確保した割り当て中のオブジェクト数とフレーム数 */
+    size_t large_objects, large_frames;
+    /** @brief ヒープが保持しているフレームの総数 */
+    size_t total_frames;
+};
+
+/** @brief ヒープの使用状況を返す */
+HeapStats GetHeapStats();
@@ -8,6 +8,8 @@
 
 #include "asmfunc.h"
 #include "segment.hpp"
+#include "timer.hpp"
+#include "trace.hpp"
 
 std::array<InterruptDescriptor, 256> idt;
 
@@ -29,18 +31,26 @@ void NotifyEndOfInterrupt() {
 }
 
 namespace {
-    std::deque<Message>* msg_queue;
+    ArrayQueue<Message>* msg_queue;
 
     __attribute__((interrupt)) void IntHandlerXHCI(InterruptFrame* frame) {
-        msg_queue->push_back(Message{Message::kInterruptXHCI});
+        Trace(TraceEvent::kXHCIInterrupt);
+        msg_queue->Push(Message{Message::kInterruptXHCI});
+        interrupt::Controller().NotifyEndOfInterrupt();
+    }
+
+    __attribute__((interrupt)) void IntHandlerLAPICTimer(InterruptFrame* frame) {
+        LAPICTimerOnInterrupt();
         interrupt::Controller().NotifyEndOfInterrupt();
     }
 }  // namespace
 
-void InitializeInterrupt(std::deque<Message>* msg_queue) {
+void InitializeInterrupt(ArrayQueue<Message>* msg_queue) {
     ::msg_queue = msg_queue;
 
     SetIDTEntry(idt[InterruptVector::kXHCI], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
                 reinterpret_cast<uint64_t>(IntHandlerXHCI), kKernelCS);
+    SetIDTEntry(idt[InterruptVector::kLAPICTimer], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+                reinterpret_cast<uint64_t>(IntHandlerLAPICTimer), kKernelCS);
     LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
 }
@@ -8,10 +8,10 @@
 
 #include <array>
 #include <cstdint>
-#include <deque>
 
 #include "x86_descriptor.hpp"
 #include "message.hpp"
+#include "queue.hpp"
 
 union InterruptDescriptorAttribute {
     uint16_t data;
@@ -63,6 +63,7 @@ class InterruptVector {
   public:
     enum Number {
         kXHCI = 0x40,
+        kLAPICTimer = 0x41,
     };
 };
 
@@ -76,7 +77,23 @@ struct InterruptFrame {
 
 void NotifyEndOfInterrupt();
 
-void InitializeInterrupt(std::deque<Message>* msg_queue);
+/** @brief スコープの間だけ割り込みを禁止する 元々禁止されていれば何もしない */
+class InterruptGuard {
+  public:
+    InterruptGuard() {
+        __asm__ volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(rflags_) : : "memory");
+    }
+    ~InterruptGuard() {
+        if (rflags_ & (1u << 9)) __asm__ volatile("sti" : : : "memory");  // IF
+    }
+    InterruptGuard(const InterruptGuard&) = delete;
+    InterruptGuard& operator=(const InterruptGuard&) = delete;
+
+  private:
+    uint64_t rflags_;
+};
+
+void InitializeInterrupt(ArrayQueue<Message>* msg_queue);
 
 namespace interrupt {
     const uintptr_t lapic_base_default = 0xfee00000;
@@ -1,9 +1,47 @@
 #include "layer.hpp"
 
 #include <algorithm>
+#include <iterator>
+
 #include "console.hpp"
 #include "logger.hpp"
 #include "font.hpp"
+#include "trace.hpp"
+
+namespace {
+    /** @brief トレースの引数用に x を上位 32 ビット，y を下位 32 ビットに詰める */
+    uint64_t PackVector(const Vector2D<int>& v) {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(v.x)) << 32) | static_cast<uint32_t>(v.y);
+    }
+
+    /**
+     * @brief a から b を取り除いた領域を，重ならない最大 4 つの矩形に分割して out に格納する
+     *
+     * @return 格納した矩形の数
+     */
+    int SubtractRectangle(const Rectangle<int>& a, const Rectangle<int>& b, Rectangle<int> out[4]) {
+        const auto inter = a & b;
+        if (IsEmpty(inter)) {
+            out[0] = a;
+            return 1;
+        }
+
+        const auto a_end = a.pos + a.size;
+        const auto inter_end = inter.pos + inter.size;
+        const Rectangle<int> strips[4] = {
+            {a.pos, {a.size.x, inter.pos.y - a.pos.y}},                                // 上
+            {{a.pos.x, inter_end.y}, {a.size.x, a_end.y - inter_end.y}},               // 下
+            {{a.pos.x, inter.pos.y}, {inter.pos.x - a.pos.x, inter.size.y}},           // 左
+            {{inter_end.x, inter.pos.y}, {a_end.x - inter_end.x, inter.size.y}},       // 右
+        };
+
+        int n = 0;
+        for (const auto& strip : strips) {
+            if (!IsEmpty(strip)) out[n++] = strip;
+        }
+        return n;
+    }
+}  // namespace
 
 Layer::Layer(unsigned int id) : id_{id} {}
 
@@ -11,6 +49,7 @@ unsigned int Layer::ID() const { return id_; }
 
 Layer& Layer::SetWindow(const std::shared_ptr<Window>& window) {
     window_ = window;
+    Reindex();
     return *this;
 }
 
@@ -18,6 +57,15 @@ std::shared_ptr<Window> Layer::GetWindow() const { return window_; }
 
 Vector2D<int> Layer::GetPosition() const { return pos_; }
 
+Rectangle<int> Layer::GetArea() const {
+    if (!window_) return {pos_, {0, 0}};
+    return {pos_, window_->Size()};
+}
+
+bool Layer::Covers(const Rectangle<int>& area) const {
+    return window_ && window_->IsOpaque() && Contains(GetArea(), area);
+}
+
 Layer& Layer::SetDraggable(bool draggable) {
     draggable_ = draggable;
     return *this;
@@ -27,18 +75,57 @@ bool Layer::IsDraggable() const { return draggable_; }
 
 Layer& Layer::Move(Vector2D<int> pos) {
     pos_ = pos;
+    Reindex();
     return *this;
 }
 
 Layer& Layer::MoveRelative(Vector2D<int> pos_diff) {
     pos_ += pos_diff;
+    Reindex();
     return *this;
 }
 
+void Layer::Reindex() {
+    if (!manager_ || height_ < 0) return;
+    manager_->UnindexLayer(this);
+    manager_->IndexLayer(this);
+}
+
+void Layer::ReindexIfOpacityChanged() {
+    if (indexed_opaque_ != (window_ && window_->IsOpaque())) Reindex();
+}
+
 void Layer::DrawTo(FrameBuffer& screen, const Rectangle<int>& area) const {
     if (window_) window_->DrawTo(screen, pos_, area);
 }
 
+void DamageList::Add(const Rectangle<int>& area) {
+    if (IsEmpty(area)) return;
+
+    auto rect = area;
+    // 統合した結果がさらに別の矩形と統合できることがあるので，変化がなくなるまで繰り返す
+    for (bool merged = true; merged;) {
+        merged = false;
+        for (auto itr = rects_.begin(); itr != rects_.end(); ++itr) {
+            const auto bounding = rect | *itr;
+            const bool overlapped = !IsEmpty(rect & *itr);
+            if (overlapped || Area(bounding) <= Area(rect) + Area(*itr)) {
+                rect = bounding;
+                rects_.erase(itr);
+                merged = true;
+                break;
+            }
+        }
+    }
+
+    if (rects_.size() >= kMaxRects) {
+        for (const auto& r : rects_) rect = rect | r;
+        rects_.clear();
+    }
+    rects_.push_back(rect);
+}
+
+void DamageList::Clear() { rects_.clear(); }
 
 void LayerManager::SetWriter(FrameBuffer* screen) {
     screen_ = screen;
@@ -47,51 +134,212 @@ void LayerManager::SetWriter(FrameBuffer* screen) {
     FrameBufferConfig back_config = screen->Config();
     back_config.frame_buffer = nullptr;
     back_buffer_.Initialize(back_config);
+
+    const auto screen_size = ScreenSize();
+    tile_count_ = {(screen_size.x + kTileSize - 1) / kTileSize,
+                   (screen_size.y + kTileSize - 1) / kTileSize};
+    tiles_.assign(tile_count_.x * tile_count_.y, {});
+    dirty_tiles_.clear();
+    const Rectangle<int> screen_area{{0, 0}, screen_size};
+    for (int y = 0; y < tile_count_.y; ++y) {
+        for (int x = 0; x < tile_count_.x; ++x) {
+            const Rectangle<int> tile_area{{x * kTileSize, y * kTileSize}, {kTileSize, kTileSize}};
+            tiles_[y * tile_count_.x + x].area = tile_area & screen_area;
+        }
+    }
+    for (auto layer : layer_stack_) IndexLayer(layer);
 }
 
 Layer& LayerManager::NewLayer() {
-    // *: cast std::unique_ptr<Layer>& to Layer&
-    return *layers_.emplace_back(new Layer{++latest_id_});
+    const unsigned int id = layers_.NextIndex() + 1;
+    auto layer = layers_.New(id);
+    if (!layer) {
+        Log(kError, "too many layers (max %lu)\n", kMaxLayers);
+        exit(1);
+    }
+    layer->manager_ = this;
+    return *layer;
+}
+
+void LayerManager::RemoveLayer(unsigned int id) {
+    auto layer = FindLayer(id);
+    if (!layer) return;
+    Hide(id);
+    Invalidate(layer->GetArea());
+    // 同じスロットに次のレイヤーが作られても，破棄したレイヤーと取り違えないようにする
+    if (cursor_layer_ == layer) cursor_layer_ = nullptr;
+    if (composed_top_ == layer) composed_top_ = nullptr;
+    layers_.Delete(layer);
+    Present();
 }
 
-void LayerManager::Draw(const Rectangle<int>& area) const {
-    for (auto layer : layer_stack_) layer->DrawTo(back_buffer_, area);
+void LayerManager::SetDeferred(bool deferred) {
+    deferred_ = deferred;
+    Present();
+}
 
-    screen_->Copy(area.pos, back_buffer_, area);
+bool LayerManager::IsDeferred() const { return deferred_; }
+
+void LayerManager::Draw(const Rectangle<int>& area) {
+    Trace(TraceEvent::kLayerDrawArea, PackVector(area.pos), PackVector(area.size));
+    Invalidate(area);
+    Present();
+}
+
+void LayerManager::Draw(unsigned int id) {
+    Trace(TraceEvent::kLayerDrawID, id);
+    auto layer = FindLayer(id);
+    if (!layer) return;
+    if (layer == cursor_layer_) {
+        DrawCursor(layer->GetArea());
+        return;
+    }
+    layer->ReindexIfOpacityChanged();
+    Invalidate(layer->GetArea());
+    Present();
+}
+
+void LayerManager::Draw(unsigned int id, const Rectangle<int>& area) {
+    Trace(TraceEvent::kLayerDrawID, id, PackVector(area.pos), PackVector(area.size));
+    auto layer = FindLayer(id);
+    if (!layer) return;
+    const auto layer_area = layer->GetArea();
+    const auto draw_area = Rectangle<int>{layer_area.pos + area.pos, area.size} & layer_area;
+    if (layer == cursor_layer_) {
+        DrawCursor(draw_area);
+        return;
+    }
+    layer->ReindexIfOpacityChanged();
+    Invalidate(draw_area);
+    Present();
+}
+
+void LayerManager::Invalidate(const Rectangle<int>& area) {
+    ForEachTile(area, [this, &area](size_t index) {
+        auto& tile = tiles_[index];
+        const auto part = area & tile.area;
+        if (IsEmpty(part)) return;
+        if (IsEmpty(tile.dirty)) dirty_tiles_.push_back(index);
+        tile.dirty = tile.dirty | part;
+    });
 }
 
-void LayerManager::Draw(unsigned int id) const {
-    bool draw = false;
-    Rectangle<int> window_area;
+void LayerManager::Flush() {
+    Trace(TraceEvent::kLayerFlushBegin, dirty_tiles_.size(), present_damage_.Rects().size());
+    // タイル同士は画素を共有しないので，それぞれ独立に合成できる
+    for (auto index : dirty_tiles_) ComposeTile(tiles_[index]);
+    dirty_tiles_.clear();
+
+    for (const auto& area : present_damage_.Rects()) {
+        screen_->Copy(area.pos, back_buffer_, area);
+        DrawCursor(area);
+    }
+    present_damage_.Clear();
+    composed_top_ = layer_stack_.empty() ? nullptr : layer_stack_.back();
+    Trace(TraceEvent::kLayerFlushEnd);
+}
 
-    for (auto layer : layer_stack_) {
-        if (layer->ID() == id) {
-            window_area.size = layer->GetWindow()->Size();
-            window_area.pos = layer->GetPosition();
-            draw = true;
+void LayerManager::ComposeTile(Tile& tile) {
+    const auto area = tile.dirty;
+    tile.dirty = {};
+    // 透過色が設定されるなどして，登録後に不透明でなくなっていたら求め直す
+    if (tile.opaque && !tile.opaque->Covers(tile.area)) UpdateOpaque(tile);
+
+    // area を完全に覆う最前面の不透明レイヤーから上だけを描けばよい
+    // tile.opaque はタイル全体を覆うので，そこより奥を調べる必要はない
+    auto first = tile.layers.begin();
+    for (auto itr = tile.layers.rbegin(); itr != tile.layers.rend(); ++itr) {
+        if (*itr == tile.opaque || (*itr)->Covers(area)) {
+            first = std::prev(itr.base());
+            break;
         }
-        if (draw) layer->DrawTo(back_buffer_, window_area);
     }
 
-    screen_->Copy(window_area.pos, back_buffer_, window_area);
+    for (auto itr = first; itr != tile.layers.end(); ++itr) {
+        if (IsEmpty((*itr)->GetArea() & area)) continue;
+        (*itr)->DrawTo(back_buffer_, area);
+    }
+    screen_->Copy(area.pos, back_buffer_, area);
+    // 下のレイヤーが変わったのでカーソルを描き直す
+    DrawCursor(area);
+}
+
+void LayerManager::Present() {
+    if (!deferred_) Flush();
 }
 
 void LayerManager::Move(unsigned int id, Vector2D<int> new_pos) {
     auto layer = FindLayer(id);
-    const auto window_size = layer->GetWindow()->Size();
-    const auto old_pos = layer->GetPosition();
+    const auto old_area = layer->GetArea();
     layer->Move(new_pos);
-    Draw({old_pos, window_size});
-    Draw(id);
+    RedrawMovedLayer(layer, old_area);
 }
 
 void LayerManager::MoveRelative(unsigned int id, Vector2D<int> pos_diff) {
     auto layer = FindLayer(id);
-    const auto window_size = layer->GetWindow()->Size();
-    const auto old_pos = layer->GetPosition();
+    const auto old_area = layer->GetArea();
     layer->MoveRelative(pos_diff);
-    Draw({old_pos, window_size});
-    Draw(id);
+    RedrawMovedLayer(layer, old_area);
+}
+
+void LayerManager::RedrawMovedLayer(Layer* layer, const Rectangle<int>& old_area) {
+    if (layer == cursor_layer_) {
+        MoveCursor(old_area);
+        return;
+    }
+    if (!MoveByScroll(layer, old_area)) {
+        Invalidate(old_area);
+        Invalidate(layer->GetArea());
+    }
+    Present();
+}
+
+bool LayerManager::MoveByScroll(Layer* layer, const Rectangle<int>& old_area) {
+    const auto new_area = layer->GetArea();
+    const Rectangle<int> screen_area{{0, 0}, ScreenSize()};
+
+    if (layer_stack_.empty() || layer_stack_.back() != layer) return false;
+    // 前回の合成時に最前面でなかったなら，バックバッファ上の移動前の領域には他のレイヤーが描かれている
+    if (composed_top_ != layer) return false;
+    if (!layer->Covers(new_area)) return false;  // 不透明なウィンドウを持たない
+    if (!Contains(screen_area, old_area) || !Contains(screen_area, new_area)) return false;
+    if (IsEmpty(old_area & new_area)) return false;
+    // 合成待ちの領域があると，バックバッファ上の移動前の画素が最新とは限らない
+    bool pending = false;
+    ForEachTile(old_area, [this, &old_area, &pending](size_t index) {
+        if (!IsEmpty(tiles_[index].dirty & old_area)) pending = true;
+    });
+    if (pending) return false;
+
+    back_buffer_.Move(new_area.pos, old_area);
+
+    Rectangle<int> exposed[4];
+    const int num_exposed = SubtractRectangle(old_area, new_area, exposed);
+    for (int i = 0; i < num_exposed; ++i) Invalidate(exposed[i]);
+    present_damage_.Add(new_area);
+    return true;
+}
+
+void LayerManager::SetCursorLayer(unsigned int id) {
+    auto layer = FindLayer(id);
+    if (!layer || layer == cursor_layer_) return;
+
+    Hide(id);
+    if (cursor_layer_) Hide(cursor_layer_->ID());
+    cursor_layer_ = layer;
+    DrawCursor(layer->GetArea());
+}
+
+void LayerManager::DrawCursor(const Rectangle<int>& area) {
+    if (!cursor_layer_) return;
+    if (IsEmpty(cursor_layer_->GetArea() & area)) return;
+    cursor_layer_->DrawTo(*screen_, area);
+}
+
+void LayerManager::MoveCursor(const Rectangle<int>& old_area) {
+    // バックバッファはカーソルを含まない合成結果なので，カーソルの下にあった画素そのものである
+    screen_->Copy(old_area.pos, back_buffer_, old_area);
+    DrawCursor(cursor_layer_->GetArea());
 }
 
 void LayerManager::UpDown(unsigned int id, int new_height) {
@@ -103,33 +351,105 @@ void LayerManager::UpDown(unsigned int id, int new_height) {
     if (new_height > layer_stack_.size()) new_height = layer_stack_.size();
 
     auto layer = FindLayer(id);
-    auto old_pos = std::find(layer_stack_.begin(), layer_stack_.end(), layer);
-    auto new_pos = layer_stack_.begin() + new_height;
-
-    if (old_pos == layer_stack_.end()) {
-        layer_stack_.insert(new_pos, layer);
+    if (layer == cursor_layer_) return;
+    const int old_height = layer->height_;
+
+    if (old_height < 0) {
+        layer_stack_.insert(layer_stack_.begin() + new_height, layer);
+        UpdateHeights(new_height);
+        IndexLayer(layer);
+        Invalidate(layer->GetArea());
+        Present();
         return;
     }
 
-    if (new_pos == layer_stack_.end()) --new_pos;
-
-    layer_stack_.erase(old_pos);
-    layer_stack_.insert(new_pos, layer);
+    if (new_height == layer_stack_.size()) --new_height;
+    if (new_height == old_height) return;
+
+    layer_stack_.erase(layer_stack_.begin() + old_height);
+    layer_stack_.insert(layer_stack_.begin() + new_height, layer);
+    UpdateHeights(std::min(old_height, new_height));
+    // 他のレイヤー同士の前後関係は変わらないので，タイルの一覧では layer だけを入れ直せばよい
+    UnindexLayer(layer);
+    IndexLayer(layer);
+    Invalidate(layer->GetArea());
+    Present();
 }
 
 void LayerManager::Hide(unsigned int id) {
     auto layer = FindLayer(id);
-    auto pos = std::find(layer_stack_.begin(), layer_stack_.end(), layer);
-    if (pos != layer_stack_.end()) layer_stack_.erase(pos);
+    if (layer && layer == cursor_layer_) {
+        cursor_layer_ = nullptr;
+        screen_->Copy(layer->GetArea().pos, back_buffer_, layer->GetArea());
+        return;
+    }
+    if (!layer || layer->height_ < 0) return;
+
+    const int height = layer->height_;
+    layer_stack_.erase(layer_stack_.begin() + height);
+    UnindexLayer(layer);
+    layer->height_ = -1;
+    UpdateHeights(height);
+}
+
+template <typename F>
+void LayerManager::ForEachTile(const Rectangle<int>& area, F func) {
+    if (IsEmpty(area)) return;
+    const auto end = area.pos + area.size;
+    const int x0 = std::max(area.pos.x, 0) / kTileSize;
+    const int y0 = std::max(area.pos.y, 0) / kTileSize;
+    const int x1 = std::min((end.x + kTileSize - 1) / kTileSize, tile_count_.x);
+    const int y1 = std::min((end.y + kTileSize - 1) / kTileSize, tile_count_.y);
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            func(static_cast<size_t>(y * tile_count_.x + x));
+        }
+    }
+}
+
+void LayerManager::IndexLayer(Layer* layer) {
+    layer->indexed_area_ = layer->GetArea();
+    layer->indexed_opaque_ = layer->window_ && layer->window_->IsOpaque();
+    ForEachTile(layer->indexed_area_, [this, layer](size_t index) {
+        auto& tile = tiles_[index];
+        auto pos = std::upper_bound(
+            tile.layers.begin(), tile.layers.end(), layer,
+            [](const Layer* lhs, const Layer* rhs) { return lhs->height_ < rhs->height_; });
+        tile.layers.insert(pos, layer);
+        UpdateOpaque(tile);
+    });
+}
+
+void LayerManager::UnindexLayer(Layer* layer) {
+    ForEachTile(layer->indexed_area_, [this, layer](size_t index) {
+        auto& tile = tiles_[index];
+        auto itr = std::find(tile.layers.begin(), tile.layers.end(), layer);
+        if (itr == tile.layers.end()) return;
+        tile.layers.erase(itr);
+        UpdateOpaque(tile);
+    });
+    layer->indexed_area_ = {};
+}
+
+void LayerManager::UpdateOpaque(Tile& tile) {
+    tile.opaque = nullptr;
+    for (auto itr = tile.layers.rbegin(); itr != tile.layers.rend(); ++itr) {
+        if ((*itr)->Covers(tile.area)) {
+            tile.opaque = *itr;
+            return;
+        }
+    }
+}
+
+void LayerManager::UpdateHeights(size_t index) {
+    for (; index < layer_stack_.size(); ++index) {
+        layer_stack_[index]->height_ = index;
+    }
 }
 
 Layer* LayerManager::FindLayer(unsigned int id) {
-    auto pred = [id](const std::unique_ptr<Layer>& elem) {
-        return elem->ID() == id;
-    };
-    auto it = std::find_if(layers_.begin(), layers_.end(), pred);
-    if (it == layers_.end()) return nullptr;
-    return it->get();
+    if (id == 0) return nullptr;
+    return layers_.At(id - 1);
 }
 
 Layer* LayerManager::FindLayerByPosition(Vector2D<int> pos, unsigned int exclude_id) const {
@@ -142,44 +462,48 @@ Layer* LayerManager::FindLayerByPosition(Vector2D<int> pos, unsigned int exclude
         return win_pos.x <= pos.x && pos.x < win_end_pos.x &&
                win_pos.y <= pos.y && pos.y < win_end_pos.y;
     };
-    auto itr = std::find_if(layer_stack_.rbegin(), layer_stack_.rend(), pred);
-    if (itr == layer_stack_.rend()) return nullptr;
+
+    if (pos.x < 0 || pos.y < 0 ||
+        pos.x >= tile_count_.x * kTileSize || pos.y >= tile_count_.y * kTileSize) {
+        // 画面外はタイルに登録されていないので，スタック全体から探す
+        auto itr = std::find_if(layer_stack_.rbegin(), layer_stack_.rend(), pred);
+        if (itr == layer_stack_.rend()) return nullptr;
+        return *itr;
+    }
+
+    // タイルの一覧は奥から手前の順なので，手前から探す
+    const auto& layers = tiles_[(pos.y / kTileSize) * tile_count_.x + pos.x / kTileSize].layers;
+    auto itr = std::find_if(layers.rbegin(), layers.rend(), pred);
+    if (itr == layers.rend()) return nullptr;
     return *itr;
 }
 
 void LayerManager::SetToFront(unsigned int id) {
-    if (id < 0) return;
-
-    Layer* layer_itr = nullptr;
-    for (auto itr : layer_stack_) {
-        if (itr->ID() == id)
-            layer_itr = itr;
-        else if (itr->IsDraggable() && layer_itr) {
-            std::iter_swap(layer_itr, itr);
-            layer_itr = itr;
-        }
+    auto layer = FindLayer(id);
+    if (!layer || layer->height_ < 0) return;
+
+    // layer より手前の draggable なレイヤーを 1 つ前の draggable な枠へ順に詰め，空いた最も手前の枠に layer を置く
+    // draggable でないレイヤーの位置は変わらない
+    std::vector<Layer*> moved{layer};
+    size_t slot = layer->height_;
+    for (size_t i = slot + 1; i < layer_stack_.size(); ++i) {
+        if (!layer_stack_[i]->IsDraggable()) continue;
+        layer_stack_[slot] = layer_stack_[i];
+        moved.push_back(layer_stack_[i]);
+        slot = i;
     }
-
-    // debug console output
-    const bool debug = true;
-    if (!debug) return;
-    const int len = 128;
-    char buf[len];
-    int pos = 0;
-    pos += snprintf(buf + pos, len - pos, "[");
-    std::vector<int> draggables{};
-    for (auto itr : layer_stack_) {
-        if (itr->IsDraggable()) {
-            draggables.push_back(itr->ID());
-            pos += snprintf(buf + pos, len - pos, "d");
-        }
-        if (itr->ID() == id) {
-            pos += snprintf(buf + pos, len - pos, "!");
-        }
-        pos += snprintf(buf + pos, len - pos, "%d, ", itr->ID());
+    if (moved.size() == 1) return;
+    layer_stack_[slot] = layer;
+    UpdateHeights(layer->height_);
+
+    // 詰めたレイヤーは間にある draggable でないレイヤーとの前後関係も変わるので，
+    // すべてタイルから外してから新しい高さで登録し直す
+    for (auto l : moved) UnindexLayer(l);
+    for (auto l : moved) {
+        IndexLayer(l);
+        Invalidate(l->GetArea());
     }
-    pos += snprintf(buf + pos, len - pos, "]");
-    Log(LogLevel::kWarn, "%s\n", buf);
+    Present();
 }
 
 namespace {
@@ -191,11 +515,11 @@ LayerManager* layer_manager;
 void InitializeLayer() {
     const auto screen_size = ScreenSize();
 
-    auto bgwindow = std::make_shared<Window>(screen_size.x, screen_size.y, screen_config.pixel_format);
+    auto bgwindow = MakeWindow(screen_size.x, screen_size.y, screen_config.pixel_format);
     DrawDesktop(*bgwindow);
 
     // list 10.20, p.258
-    auto console_window = std::make_shared<Window>(
+    auto console_window = MakeWindow(
         Console::kColumns * KERNEL_GLYPH_WIDTH,
         Console::kRows * KERNEL_GLYPH_HEIGHT,
         screen_config.pixel_format);
@@ -5,8 +5,11 @@
 #include <vector>
 
 #include "graphics.hpp"
+#include "object_pool.hpp"
 #include "window.hpp"
 
+class LayerManager;
+
 class Layer {
   public:
     /** @brief 指定された ID を持つレイヤーを生成する */
@@ -14,12 +17,21 @@ class Layer {
     /** @brief このインスタンスの ID を返す */
     unsigned int ID() const;
 
-    /** @brief ウィンドウを設定する 既存のウィンドウはこのレイヤーから外れる */
+    /**
+     * @brief ウィンドウを設定する 既存のウィンドウはこのレイヤーから外れる
+     *
+     * SetWindow, Move, MoveRelative は表示中のレイヤーに対して呼ばれると
+     * LayerManager の空間インデックスも更新する
+     */
     Layer& SetWindow(const std::shared_ptr<Window>& window);
     /** @brief 設定されたウィンドウを返す */
     std::shared_ptr<Window> GetWindow() const;
     /** @brief レイヤーの原点座標を取得 */
     Vector2D<int> GetPosition() const;
+    /** @brief レイヤーが画面上で占める矩形領域を取得 ウィンドウがなければ空の矩形 */
+    Rectangle<int> GetArea() const;
+    /** @brief 指定した領域がこのレイヤーの不透明なウィンドウで完全に覆われるなら true */
+    bool Covers(const Rectangle<int>& area) const;
 
     /** @brief レイヤーの位置情報を指定された絶対座標へと更新する 再描画はされない */
     Layer& Move(Vector2D<int> pos);
@@ -33,10 +45,48 @@ class Layer {
     bool IsDraggable() const;
 
   private:
+    friend class LayerManager;
+
     unsigned int id_;
+    /** @brief このレイヤーを生成した LayerManager */
+    LayerManager* manager_{nullptr};
     Vector2D<int> pos_{};
     std::shared_ptr<Window> window_{};
     bool draggable_{false};
+    /** @brief LayerManager のレイヤースタック上の位置 UpDown や Hide のたびに更新される */
+    int height_{-1};
+    /** @brief LayerManager の空間インデックスに登録されている領域 */
+    Rectangle<int> indexed_area_{};
+    /** @brief 空間インデックスに登録した時点でウィンドウが不透明だったか */
+    bool indexed_opaque_{false};
+
+    /** @brief 表示中なら，変更後の領域で空間インデックスに登録し直す */
+    void Reindex();
+    /** @brief ウィンドウの不透明さが登録時から変わっていれば登録し直す */
+    void ReindexIfOpacityChanged();
+};
+
+/**
+ * @brief 再描画が必要な画面上の領域 (ダメージ領域) の集合
+ *
+ * 重なり合う矩形，あるいは統合しても面積がほとんど増えない矩形は
+ * 登録時に 1 つの矩形へまとめられる
+ */
+class DamageList {
+  public:
+    /** @brief 保持する矩形の最大数 これを超えると全体を 1 つの矩形にまとめる */
+    static const size_t kMaxRects = 16;
+
+    /** @brief 領域を追加する 面積を持たない矩形は無視される */
+    void Add(const Rectangle<int>& area);
+    /** @brief すべての領域を破棄する */
+    void Clear();
+    bool Empty() const { return rects_.empty(); }
+
+    const std::vector<Rectangle<int>>& Rects() const { return rects_; }
+
+  private:
+    std::vector<Rectangle<int>> rects_{};
 };
 
 class LayerManager {
@@ -46,14 +96,47 @@ class LayerManager {
     /**
      * @brief 新しいレイヤーを生成して参照を返す
      *
-     * 新しく生成されたレイヤーの実体は LayerManager 内部のコンテナで保持される
+     * 新しく生成されたレイヤーの実体は LayerManager 内部のプールで保持される
+     * kMaxLayers 個を超えて生成しようとした場合はエラーを記録して停止する
      */
     Layer& NewLayer();
+    /**
+     * @brief レイヤーを非表示にして破棄する
+     *
+     * ID は後で生成するレイヤーに再利用されるので，マウスのドラッグ対象やコンソールなど
+     * 他所で保持している ID は破棄した時点で無効となり，別のレイヤーを指しうる
+     */
+    void RemoveLayer(unsigned int id);
+
+    /**
+     * @brief 描画要求をすぐに画面へ反映せず，Flush を呼ぶまで溜めておくかを設定する
+     *
+     * true の間，Draw や Move はダメージ領域を登録するだけとなり，
+     * イベントループの 1 周ごとに Flush を呼び出してまとめて画面へ転送する
+     */
+    void SetDeferred(bool deferred);
+    bool IsDeferred() const;
 
     /** @brief 現在表示状態にあるレイヤーを描画する */
-    void Draw(const Rectangle<int>& area) const;
-    /** @brief 指定したレイヤーに設定されているウィンドウの描画領域内を再描画 */
-    void Draw(unsigned int id) const;
+    void Draw(const Rectangle<int>& area);
+    /**
+     * @brief 指定したレイヤーに設定されているウィンドウの描画領域内を再描画
+     *
+     * ウィンドウの透過色を変えたときもこれを呼ぶと，タイルの不透明なレイヤーの情報が更新される
+     */
+    void Draw(unsigned int id);
+    /** @brief 指定したレイヤーのウィンドウのうち，ウィンドウ座標系で area の部分を再描画 */
+    void Draw(unsigned int id, const Rectangle<int>& area);
+
+    /** @brief 指定した領域を再描画が必要な領域として登録する 描画はされない */
+    void Invalidate(const Rectangle<int>& area);
+    /**
+     * @brief 再描画が必要なタイルを合成して画面へ転送する
+     *
+     * 各タイルでは，そのタイルに重なるレイヤーのうち再描画する領域を完全に覆う
+     * 最前面の不透明なレイヤーから上だけを描く
+     */
+    void Flush();
 
     /** @brief レイヤーの位置情報を指定された絶対座標へと更新する 再描画も行う */
     void Move(unsigned int id, Vector2D<int> new_pos);
@@ -71,19 +154,107 @@ class LayerManager {
     /** @brief レイヤーを非表示とする */
     void Hide(unsigned int id);
 
+    /**
+     * @brief 指定したレイヤーをカーソルプレーンとして表示する
+     *
+     * カーソルプレーンのレイヤーは通常のレイヤーの重ね合わせには加わらず，
+     * 合成済みの画面の上に直接描かれる 移動時は旧位置をバックバッファから復元して
+     * 新位置に描き直すだけなので，他のレイヤーの再合成は起こらない
+     * UpDown でカーソルプレーンの高さを変えることはできず，Hide すると通常の非表示レイヤーに戻る
+     */
+    void SetCursorLayer(unsigned int id);
+
+    /**
+     * @brief 指定した座標を含む表示中のレイヤーのうち最前面のものを返す
+     *
+     * 座標を含むタイルに登録されたレイヤーだけを調べるので，全レイヤーを走査することはない
+     */
     Layer* FindLayerByPosition(Vector2D<int> pos, unsigned int exclude_id) const;
 
     // draggable なレイヤの中で最前面に配置する
     void SetToFront(unsigned int id);
 
+    /** @brief 同時に存在できるレイヤーの最大数 */
+    static const size_t kMaxLayers = 256;
+
   private:
     FrameBuffer* screen_{nullptr};
     mutable FrameBuffer back_buffer_{};
-    std::vector<std::unique_ptr<Layer>> layers_{};
+    /** @brief レイヤーの実体 ID が i のレイヤーはプールの i - 1 番目に置かれる (ID 0 は無効) */
+    ObjectPool<Layer, kMaxLayers> layers_{};
     std::vector<Layer*> layer_stack_{};
-    unsigned int latest_id_{0};
+
+    /** @brief 合成と空間インデックスの単位となるタイルの一辺のピクセル数 */
+    static const int kTileSize = 64;
+
+    /**
+     * @brief 画面を kTileSize 四方に分割したタイル
+     *
+     * レイヤーの一覧と最前面の不透明なレイヤーは UpDown, Hide, Move のたびに差分で更新する
+     * 合成はタイル単位で行い，あるタイルの合成はそのタイルの範囲の画素しか読み書きしない
+     */
+    struct Tile {
+        /** @brief タイルの画面上の領域 画面端では kTileSize 四方より小さい */
+        Rectangle<int> area;
+        /** @brief タイルに重なる表示中のレイヤー 奥から手前の順に並ぶ */
+        std::vector<Layer*> layers;
+        /**
+         * @brief タイル全体を覆う最前面の不透明なレイヤー これより奥のレイヤーは描かなくてよい
+         *
+         * ウィンドウの透過色は表示中にも変わりうるので，合成時に覆っていることを確かめてから使う
+         */
+        Layer* opaque;
+        /** @brief 次の Flush で再合成が必要な領域 */
+        Rectangle<int> dirty;
+    };
+
+    /** @brief y 行 x 列目のタイルは tiles_[y * tile_count_.x + x] */
+    std::vector<Tile> tiles_{};
+    Vector2D<int> tile_count_{};
+    /** @brief dirty が空でないタイルの番号 */
+    std::vector<size_t> dirty_tiles_{};
+    /** @brief 前回の Flush の時点で最前面にあったレイヤー */
+    Layer* composed_top_{nullptr};
+    /** @brief バックバッファは最新で，画面への転送だけが必要な領域 */
+    DamageList present_damage_{};
+    bool deferred_{false};
+    /** @brief カーソルプレーンに表示しているレイヤー なければ nullptr */
+    Layer* cursor_layer_{nullptr};
+
+    /** @brief old_area から移動したレイヤーについて，再描画が必要な領域を登録して Present する */
+    void RedrawMovedLayer(Layer* layer, const Rectangle<int>& old_area);
+    /**
+     * @brief 最前面の不透明なレイヤーの移動を，バックバッファ内のコピーで済ませる
+     *
+     * 移動前後の領域が重なる場合に限り，移動前の領域の画素をバックバッファ内で移動先へ
+     * コピーし，露出した帯状の領域だけを再合成の対象とする 適用できなければ false を返す
+     */
+    bool MoveByScroll(Layer* layer, const Rectangle<int>& old_area);
+    /** @brief カーソルプレーンのレイヤーを screen_ の area の範囲に描く */
+    void DrawCursor(const Rectangle<int>& area);
+    /** @brief カーソルプレーンのレイヤーが old_area から移動したときの画面の更新 */
+    void MoveCursor(const Rectangle<int>& old_area);
+
+    /** @brief 遅延描画モードでなければ Flush する */
+    void Present();
 
     Layer* FindLayer(unsigned int id);
+
+    /** @brief area と重なるタイルそれぞれについて，そのタイルの番号を引数に func を呼ぶ */
+    template <typename F>
+    void ForEachTile(const Rectangle<int>& area, F func);
+    /** @brief レイヤーを現在の領域と高さに従って各タイルの一覧に加える */
+    void IndexLayer(Layer* layer);
+    /** @brief レイヤーを各タイルの一覧から外す */
+    void UnindexLayer(Layer* layer);
+    /** @brief タイルの最前面の不透明なレイヤーを求め直す */
+    void UpdateOpaque(Tile& tile);
+    /** @brief タイルの dirty の範囲を合成して画面へ転送する */
+    void ComposeTile(Tile& tile);
+    /** @brief layer_stack_ の index 番目以降のレイヤーの高さを振り直す */
+    void UpdateHeights(size_t index);
+
+    friend class Layer;
 };
 
 extern LayerManager* layer_manager;
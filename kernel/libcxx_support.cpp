@@ -1,4 +1,4 @@
-#include <cerrno>
+#include <cstdlib>
 #include <new>
 
 int printk(const char* format, ...);
@@ -9,8 +9,3 @@ std::new_handler std::get_new_handler() noexcept {
         exit(1);
     };
 }
-
-extern "C" int posix_memalign(void**, size_t, size_t) {
-    return ENOMEM;
-}
-
@@ -1,12 +1,78 @@
 #include "logger.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
 
 #include "console.hpp"
 
 namespace{
     LogLevel log_level = kWarn;
+
+    /**
+     * @brief ログリングバッファの 1 スロット
+     *
+     * seq はスロットの状態を表す 書き込み位置 pos のスロットは，pos が属する周の先頭位置を
+     * base = LapBase(pos) として seq == base なら空き，seq == base + 1 なら書き込み済みで読み出し待ち
+     * ゼロ初期化された状態が 0 周目の空きとなるので初期化処理は要らない
+     */
+    struct LogSlot {
+        std::atomic<uint64_t> seq;
+        uint8_t len;
+        char text[64 - sizeof(std::atomic<uint64_t>) - sizeof(uint8_t)];
+    };
+    static_assert(sizeof(LogSlot) == 64);
+
+    const size_t kLogSlots = 1024;  // 2 の冪
+    LogSlot log_slots[kLogSlots];
+
+    /** @brief 次に予約する書き込み位置 */
+    std::atomic<uint64_t> log_tail{0};
+    /** @brief 次に読み出す位置 DrainLog だけが更新する */
+    uint64_t log_head = 0;
+    std::atomic<size_t> log_dropped{0};
+    /** @brief DrainLog が最後にコンソールへ報告した時点の log_dropped */
+    size_t log_reported_dropped = 0;
+    std::atomic<bool> log_draining{false};
+    bool log_deferred = false;
+
+    /** @brief 書き込み位置 pos が属する周の先頭位置 */
+    uint64_t LapBase(uint64_t pos) {
+        return pos & ~static_cast<uint64_t>(kLogSlots - 1);
+    }
+
+    /** @brief 長さ len の文字列を格納できるだけのスロットを予約し，書き込む */
+    bool PushLog(const char* s, size_t len) {
+        const size_t kTextSize = sizeof(LogSlot::text);
+        const size_t n = (len + kTextSize - 1) / kTextSize;
+        if (n == 0) return true;
+        if (n > kLogSlots) return false;
+
+        uint64_t pos = log_tail.load(std::memory_order_relaxed);
+        while (true) {
+            // 読み出しは先頭から順に行われるので，最後のスロットが空いていればその前も空いている
+            const auto last_pos = pos + n - 1;
+            const auto& last = log_slots[last_pos % kLogSlots];
+            if (last.seq.load(std::memory_order_acquire) != LapBase(last_pos)) {
+                return false;
+            }
+            if (log_tail.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            auto& slot = log_slots[(pos + i) % kLogSlots];
+            const size_t chunk = std::min(kTextSize, len - i * kTextSize);
+            memcpy(slot.text, s + i * kTextSize, chunk);
+            slot.len = chunk;
+            slot.seq.store(LapBase(pos + i) + 1, std::memory_order_release);
+        }
+        return true;
+    }
 }
 
 extern Console* console;
@@ -23,6 +89,51 @@ int Log(LogLevel level, const char* format, ...){
     res = vsprintf(s, format, ap);
     va_end(ap);
 
-    console->PutString(s);
+    LogString(s);
     return res;
 }
+
+void LogString(const char* s) {
+    if (!PushLog(s, strlen(s))) {
+        log_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (!log_deferred) DrainLog();
+}
+
+void DrainLog() {
+    if (!console) return;
+    // 書き出し中に割り込みハンドラが LogString を呼んでも再入しない
+    if (log_draining.exchange(true, std::memory_order_acquire)) return;
+
+    char s[sizeof(LogSlot::text) + 1];
+    while (true) {
+        auto& slot = log_slots[log_head % kLogSlots];
+        if (slot.seq.load(std::memory_order_acquire) != LapBase(log_head) + 1) break;
+        memcpy(s, slot.text, slot.len);
+        s[slot.len] = '\0';
+        slot.seq.store(LapBase(log_head) + kLogSlots, std::memory_order_release);
+        ++log_head;
+        console->PutString(s);
+    }
+
+    // 報告自体がまた捨てられないよう，リングバッファを通さずにコンソールへ書く
+    const size_t dropped = log_dropped.load(std::memory_order_relaxed);
+    if (dropped != log_reported_dropped) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "log ring is full: %lu messages dropped\n",
+                 dropped - log_reported_dropped);
+        console->PutString(msg);
+        log_reported_dropped = dropped;
+    }
+
+    log_draining.store(false, std::memory_order_release);
+}
+
+void SetLogDeferred(bool deferred) {
+    log_deferred = deferred;
+    if (!deferred) DrainLog();
+}
+
+size_t LogDropped() {
+    return log_dropped.load(std::memory_order_relaxed);
+}
@@ -6,6 +6,8 @@
 
 #pragma once
 
+#include <cstddef>
+
 enum LogLevel {
     kError = 3,
     kWarn = 4,
@@ -29,3 +31,26 @@ void SetLogLevel(LogLevel level);
  * @param format 書式文字列 printk と互換
  */
 int Log(LogLevel level, const char* format, ...);
+
+/**
+ * @brief 文字列をログリングバッファに書き込む
+ * ロックを取らないので割り込みハンドラからも呼び出せる
+ * リングバッファに空きがなければ文字列は捨てられ，捨てた数が LogDropped に加算される
+ */
+void LogString(const char* s);
+
+/**
+ * @brief ログリングバッファに溜まった文字列をコンソールへ書き出す
+ * 前回から捨てられたログがあれば，その数もあわせて書き出す
+ * 割り込みハンドラから呼び出してはならない
+ */
+void DrainLog();
+
+/**
+ * @brief ログの書き出しを遅延するかを設定する
+ * 遅延しない場合 LogString のたびに DrainLog を呼び出す 遅延する場合はイベントループが DrainLog を呼び出す
+ */
+void SetLogDeferred(bool deferred);
+
+/** @brief リングバッファに空きがなく捨てられたログの数 */
+size_t LogDropped();
@@ -4,10 +4,10 @@
  * カーネル本体のプログラムを書いたファイル．
  */
 
+#include <array>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
-#include <deque>
 #include <limits>
 #include <numeric>
 #include <vector>
@@ -26,8 +26,10 @@
 #include "mouse.hpp"
 #include "paging.hpp"
 #include "pci.hpp"
+#include "queue.hpp"
 #include "segment.hpp"
 #include "timer.hpp"
+#include "trace.hpp"
 #include "usb/xhci/xhci.hpp"
 #include "window.hpp"
 
@@ -40,8 +42,8 @@ int printk(const char *format, ...) {
     result = vsprintf(s, format, ap);
     va_end(ap);
 
-    console->PutString(s);
-    
+    LogString(s);
+
     return result;
 }
 
@@ -53,7 +55,7 @@ unsigned int counter_window_layer_id;
 
 void InitializeNormalWindow() {
     // list 10.4, p.249
-    normal_window.emplace_back(std::make_shared<Window>(160, 68, screen_config.pixel_format));
+    normal_window.emplace_back(MakeWindow(160, 68, screen_config.pixel_format));
     DrawWindow(*normal_window.back(), "Hello World 1");
     WriteString(*normal_window.back(), {24, 28}, "Welcome to", {0, 0, 0});
     WriteString(*normal_window.back(), {24, 44}, " MikanOS world!", {0, 0, 0});
@@ -64,7 +66,7 @@ void InitializeNormalWindow() {
                                          .Move({300, 100})
                                          .ID());
 
-    normal_window.emplace_back(std::make_shared<Window>(160, 68, screen_config.pixel_format));
+    normal_window.emplace_back(MakeWindow(160, 68, screen_config.pixel_format));
     DrawWindow(*normal_window.back(), "Hello World 2");
     WriteString(*normal_window.back(), {24, 28}, "This is", {0, 0, 0});
     WriteString(*normal_window.back(), {24, 44}, " the second", {0, 0, 0});
@@ -74,7 +76,7 @@ void InitializeNormalWindow() {
                                          .SetDraggable(true)
                                          .Move({300, 200})
                                          .ID());
-    normal_window.emplace_back(std::make_shared<Window>(160, 68, screen_config.pixel_format));
+    normal_window.emplace_back(MakeWindow(160, 68, screen_config.pixel_format));
     DrawWindow(*normal_window.back(), "Hello World 3");
     WriteString(*normal_window.back(), {24, 28}, "I am", {0, 0, 0});
     WriteString(*normal_window.back(), {24, 44}, " the third win", {0, 0, 0});
@@ -86,7 +88,7 @@ void InitializeNormalWindow() {
                                          .ID());
 
     // list 10.8, p.252
-    normal_window.emplace_back(std::make_shared<Window>(160, 52, screen_config.pixel_format));
+    normal_window.emplace_back(MakeWindow(160, 52, screen_config.pixel_format));
     DrawWindow(*normal_window.back(), "Count, Count");
 
     normal_window_layer_id.push_back(layer_manager->NewLayer()
@@ -104,7 +106,8 @@ void InitializeNormalWindow() {
     }
 }
 
-std::deque<Message> *main_queue;
+std::array<Message, 256> main_queue_data;
+ArrayQueue<Message> *main_queue;
 
 void InitializeFontData(uint8_t *src, uint8_t dst[128][KERNEL_GLYPH_HEIGHT]) {
     for (int i = 0; i < 0x80; ++i) {
@@ -127,18 +130,18 @@ extern "C" void KernelMainNewStack(const FrameBufferConfig &frame_buffer_config_
     InitializeConsole();
 
     InitializeFontData(font_data_ref, font_data);
+    InitializeGlyphCache();
 
     printk("Welcome to MikanOS! " __DATE__ " " __TIME__ " rev.001\n");
     SetLogLevel(kWarn);
 
-    InitializeLAPICTimer();
-
     InitializeSegmentation();
-    InitializePaging();
+    InitializePaging(memory_map);
     InitializeMemoryManager(memory_map);
 
-    ::main_queue = new std::deque<Message>(32);
+    ::main_queue = new ArrayQueue<Message>(main_queue_data);
     InitializeInterrupt(main_queue);
+    InitializeLAPICTimer(*main_queue);
 
     InitializePCI();
     usb::xhci::Initialize();
@@ -148,34 +151,66 @@ extern "C" void KernelMainNewStack(const FrameBufferConfig &frame_buffer_config_
     InitializeMouse();
 
     layer_manager->Draw({{0, 0}, ScreenSize()});
+    // 以降の描画要求はフレームタイマーごとにまとめて画面へ転送する
+    layer_manager->SetDeferred(true);
+    SetLogDeferred(true);
+    // イベントループでの処理をトレースに記録する 中ボタンのクリックで書き出せる
+    SetTraceEnabled(true);
 
     char str[128];
     unsigned int count = 0;
+    std::array<Message, 32> msgs;
+    size_t dropped_msgs = 0;
+
+    // 周期的な処理 (カウンタの再描画と画面への転送) はタイマーのタイムアウトを契機に行う
+    const int kFrameTimerValue = 1;
+    const unsigned long kFrameInterval = kTimerFreq / 50;  // 20 ms
+    Timer frame_timer;
+    timer_manager->Add(frame_timer, timer_manager->CurrentTick() + kFrameInterval, kFrameTimerValue);
 
     // event loop
     while (true) {
-        sprintf(str, "%010u", ++count);
-        FillRectangle(*normal_window[counter_window_idx], {24, 28}, {KERNEL_GLYPH_WIDTH * 10, KERNEL_GLYPH_HEIGHT}, {0xc6, 0xc6, 0xc6});
-        WriteString(*normal_window[counter_window_idx], {24, 28}, str, {0, 0, 0});
-        layer_manager->Draw(counter_window_layer_id);
-
-        __asm__("cli");  // Clear Interrupt Flag
-        if (main_queue->size() == 0) {
-            __asm__("sti");
+        // キューの確認から hlt までの間に割り込みを取りこぼさないよう，割り込みを禁止して確認する
+        // sti の直後の命令までは割り込みが入らないので，sti; hlt は割り込みを待ってから再開する
+        __asm__("cli");
+        if (main_queue->Count() == 0) {
+            __asm__("sti\n\thlt");
             continue;
         }
-
-        Message msg = main_queue->front();
-        main_queue->pop_front();
         __asm__("sti");
 
-        switch (msg.type) {
-            case Message::kInterruptXHCI:
-                usb::xhci::ProcessEvents();
-                break;
-            default:
-                Log(kError, "Unknown message type: %d\n", msg.type);
+        // 割り込みハンドラとはロックなしで共有できるので，割り込みを禁止せずにまとめて取り出す
+        const auto num_msgs = main_queue->PopBatch(msgs.data(), msgs.size());
+        if (main_queue->Dropped() != dropped_msgs) {
+            Log(kWarn, "main queue is full: %lu messages dropped\n", main_queue->Dropped() - dropped_msgs);
+            dropped_msgs = main_queue->Dropped();
+        }
+
+        bool frame_due = false;
+        for (size_t i = 0; i < num_msgs; ++i) {
+            switch (msgs[i].type) {
+                case Message::kInterruptXHCI:
+                    usb::xhci::ProcessEvents();
+                    break;
+                case Message::kTimerTimeout:
+                    if (msgs[i].arg.timer.value == kFrameTimerValue) {
+                        frame_due = true;
+                        timer_manager->Add(frame_timer, msgs[i].arg.timer.timeout + kFrameInterval, kFrameTimerValue);
+                    }
+                    break;
+                default:
+                    Log(kError, "Unknown message type: %d\n", msgs[i].type);
+            }
         }
+        if (!frame_due) continue;
+
+        sprintf(str, "%010u", ++count);
+        FillRectangle(*normal_window[counter_window_idx], {24, 28}, {KERNEL_GLYPH_WIDTH * 10, KERNEL_GLYPH_HEIGHT}, {0xc6, 0xc6, 0xc6});
+        WriteString(*normal_window[counter_window_idx], {24, 28}, str, {0, 0, 0});
+        layer_manager->Draw(counter_window_layer_id);
+        DrainLog();
+        console->Flush();
+        layer_manager->Flush();
     }
 }
 
@@ -1,40 +1,142 @@
 #include "memory_manager.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "interrupt.hpp"
 #include "logger.hpp"
+#include "paging.hpp"
+#include "spinlock.hpp"
+#include "trace.hpp"
 
-BitmapMemoryManager::BitmapMemoryManager() : alloc_map_{}, range_begin_{FrameID{0}}, range_end_{FrameID{kFrameCount}} {}
+BitmapMemoryManager::BitmapMemoryManager(MapLineType* alloc_map, size_t frame_count)
+    : alloc_map_{alloc_map}, frame_count_{frame_count}, free_lists_{},
+      range_begin_{FrameID{0}}, range_end_{FrameID{frame_count}} {
+    memset(alloc_map_, 0, BitmapBytes(frame_count_));
+}
 
-// first-fit
+// buddy system
 WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames) {
-    size_t start_frame_id = range_begin_.ID();
-    while (true) {
-        size_t i = 0;
-        for (; i < num_frames; ++i){
-            if (start_frame_id + i >= range_end_.ID()) return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
-            // break if already allocated
-            if (GetBit(FrameID{start_frame_id + i})) break;
-        }
-        if(i == num_frames) {
-            // found the first (num_frames) frames space
-            MarkAllocated(FrameID{start_frame_id}, num_frames);
-            return {FrameID{start_frame_id}, MAKE_ERROR(Error::kSuccess)};
-        }
-        // re-search from the next frame
-        start_frame_id += i + 1;
+    unsigned int order = 0;
+    while ((static_cast<size_t>(1) << order) < num_frames) ++order;
+
+    unsigned int k = order;
+    while (k <= kMaxOrder && free_lists_[k] == nullptr) ++k;
+    if (k > kMaxOrder) {
+        Trace(TraceEvent::kMemoryAllocate, num_frames, kNullFrame.ID(), Error::kNoEnoughMemory);
+        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    auto block = free_lists_[k];
+    RemoveBlock(block);
+    const auto start_frame_id = FrameOf(block);
+    // 大きすぎるブロックは半分に分け，後ろ半分を空きに戻していく
+    while (k > order) {
+        --k;
+        PushBlock(start_frame_id + (static_cast<size_t>(1) << k), k);
     }
+
+    MarkAllocated(FrameID{start_frame_id}, num_frames);
+    PushRange(start_frame_id + num_frames, start_frame_id + (static_cast<size_t>(1) << order));
+    Trace(TraceEvent::kMemoryAllocate, num_frames, start_frame_id, Error::kSuccess);
+    return {FrameID{start_frame_id}, MAKE_ERROR(Error::kSuccess)};
 }
 
 Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames){
-    for (size_t i = 0; i < num_frames; ++i) SetBit(FrameID{start_frame.ID() + i}, false);
+    const auto begin = start_frame.ID();
+    const auto end = begin + num_frames;
+    if (begin < range_begin_.ID() || end > range_end_.ID()) {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    // 前から順に整列したブロックに分けて解放する ビットはブロックごとに，結合の直前に落とす
+    for (auto frame = begin; frame < end; ) {
+        const auto order = MaxOrderAt(frame, end);
+        const auto size = static_cast<size_t>(1) << order;
+        SetBits(frame, frame + size, false);
+        FreeBlockCoalescing(frame, order);
+        frame += size;
+    }
     return MAKE_ERROR(Error::kSuccess);
 }
 
 void BitmapMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames) {
-    for (size_t i = 0; i < num_frames; ++i) SetBit(FrameID{start_frame.ID() + i}, true);
+    const auto begin = std::min(start_frame.ID(), frame_count_);
+    SetBits(begin, std::min(begin + num_frames, frame_count_), true);
 }
 
 void BitmapMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end) {
     range_begin_ = range_begin;
     range_end_ = range_end;
+
+    free_lists_.fill(nullptr);
+    auto frame = FindBit(range_begin_.ID(), range_end_.ID(), false);
+    while (frame < range_end_.ID()) {
+        const auto run_end = FindBit(frame, range_end_.ID(), true);
+        PushRange(frame, run_end);
+        frame = FindBit(run_end, range_end_.ID(), false);
+    }
+}
+
+size_t BitmapMemoryManager::CountFreeFrames() const {
+    size_t allocated = 0;
+    const auto begin = range_begin_.ID(), end = range_end_.ID();
+    for (auto line = begin / kBitsPerMapLine; line * kBitsPerMapLine < end; ++line) {
+        auto bits = alloc_map_[line];
+        const auto line_begin = line * kBitsPerMapLine;
+        // 範囲外のビットは数えない
+        if (line_begin < begin) bits &= ~static_cast<MapLineType>(0) << (begin - line_begin);
+        if (line_begin + kBitsPerMapLine > end) bits &= ~(~static_cast<MapLineType>(0) << (end - line_begin));
+        allocated += __builtin_popcountl(bits);
+    }
+    return end - begin - allocated;
+}
+
+unsigned int BitmapMemoryManager::MaxOrderAt(size_t frame, size_t end) {
+    unsigned int order = frame == 0 ? kMaxOrder : std::min<unsigned int>(__builtin_ctzl(frame), kMaxOrder);
+    while (frame + (static_cast<size_t>(1) << order) > end) --order;
+    return order;
+}
+
+void BitmapMemoryManager::PushBlock(size_t frame, unsigned int order) {
+    auto block = BlockAt(frame);
+    block->prev = nullptr;
+    block->next = free_lists_[order];
+    block->order = order;
+    if (block->next) block->next->prev = block;
+    free_lists_[order] = block;
+}
+
+void BitmapMemoryManager::RemoveBlock(FreeBlock* block) {
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        free_lists_[block->order] = block->next;
+    }
+    if (block->next) block->next->prev = block->prev;
+}
+
+void BitmapMemoryManager::FreeBlockCoalescing(size_t frame, unsigned int order) {
+    while (order < kMaxOrder) {
+        const auto buddy = frame ^ (static_cast<size_t>(1) << order);
+        if (buddy < range_begin_.ID() || buddy + (static_cast<size_t>(1) << order) > range_end_.ID()) break;
+        // 空いているバディの先頭フレームは必ず order 以下の空きブロックの先頭になっている
+        if (GetBit(FrameID{buddy})) break;
+        auto buddy_block = BlockAt(buddy);
+        if (buddy_block->order != order) break;
+        RemoveBlock(buddy_block);
+        frame &= ~(static_cast<size_t>(1) << order);
+        ++order;
+    }
+    PushBlock(frame, order);
+}
+
+void BitmapMemoryManager::PushRange(size_t begin, size_t end) {
+    while (begin < end) {
+        const auto order = MaxOrderAt(begin, end);
+        PushBlock(begin, order);
+        begin += static_cast<size_t>(1) << order;
+    }
 }
 
 bool BitmapMemoryManager::GetBit(FrameID frame) const {
@@ -44,46 +146,110 @@ bool BitmapMemoryManager::GetBit(FrameID frame) const {
     return (alloc_map_[line_index] & (static_cast<MapLineType>(1) << bit_index)) != 0;
 }
 
-void BitmapMemoryManager::SetBit(FrameID frame, bool allocated) {
-    auto line_index = frame.ID() / kBitsPerMapLine;
-    auto bit_index = frame.ID() % kBitsPerMapLine;
+void BitmapMemoryManager::SetBits(size_t begin, size_t end, bool allocated) {
+    while (begin < end) {
+        const auto line_index = begin / kBitsPerMapLine;
+        const auto bit_index = begin % kBitsPerMapLine;
+        const auto count = std::min(kBitsPerMapLine - bit_index, end - begin);
 
-    const auto mask = static_cast<MapLineType>(1) << bit_index;
-    if (allocated) {
-        alloc_map_[line_index] |= mask;
-    } else {
-        alloc_map_[line_index] &= ~mask;
+        const auto mask = count == kBitsPerMapLine
+            ? ~static_cast<MapLineType>(0)
+            : ((static_cast<MapLineType>(1) << count) - 1) << bit_index;
+        if (allocated) {
+            alloc_map_[line_index] |= mask;
+        } else {
+            alloc_map_[line_index] &= ~mask;
+        }
+        begin += count;
     }
 }
 
-extern "C" caddr_t program_break, program_break_end;
+size_t BitmapMemoryManager::FindBit(size_t begin, size_t end, bool allocated) const {
+    if (begin >= end) return end;
+    auto line_index = begin / kBitsPerMapLine;
+    // 探しているビットが 1 になるよう反転し，begin より前のビットは落とす
+    auto bits = (allocated ? alloc_map_[line_index] : ~alloc_map_[line_index])
+        & (~static_cast<MapLineType>(0) << (begin % kBitsPerMapLine));
+    while (bits == 0) {
+        ++line_index;
+        if (line_index * kBitsPerMapLine >= end) return end;
+        bits = allocated ? alloc_map_[line_index] : ~alloc_map_[line_index];
+    }
+    return std::min(line_index * kBitsPerMapLine + __builtin_ctzl(bits), end);
+}
 
 namespace {
     char memory_manager_buf[sizeof(BitmapMemoryManager)];
     BitmapMemoryManager* memory_manager;
+    /** @brief memory_manager を CPU 間で排他するロック 割り込みを禁止してから取る */
+    SpinLock memory_manager_lock;
 
-    Error InitializeHeap(BitmapMemoryManager& memory_manager) {
-        const int kHeapFrames = 64 * 512;  // 64 * 512 [frames] * 4 [KiB / frame] = 128 [MiB]
-        const auto heap_start = memory_manager.Allocate(kHeapFrames);
+    /** @brief キャッシュの補充と返却を一度に行うフレーム数 */
+    const size_t kFrameCacheBatch = 16;
 
-        if (heap_start.error) return heap_start.error;
+    /**
+     * @brief CPU ごとの単一フレームのキャッシュ (マガジン)
+     * 自分の CPU のキャッシュにしか触らないので，割り込みを禁止するだけでロックは要らない
+     */
+    struct FrameCache {
+        std::array<size_t, 2 * kFrameCacheBatch> frames;
+        size_t count;
+    };
+    /** @brief LAPIC ID ごとのキャッシュ */
+    std::array<FrameCache, 256> frame_caches;
 
-        program_break = reinterpret_cast<caddr_t>(heap_start.value.ID() * kBytesPerFrame);
-        program_break_end = program_break + kHeapFrames * kBytesPerFrame;
-        return MAKE_ERROR(Error::kSuccess);
+    FrameCache& CurrentFrameCache() {
+        return frame_caches[interrupt::Controller().GetLAPICID()];
     }
 }  // namespace
 
 void InitializeMemoryManager(const MemoryMap& memory_map) {
-    ::memory_manager = new (memory_manager_buf) BitmapMemoryManager;
-
     // assuming identity mapping
+    // アイデンティティマップされていないメモリには空きリストの節を置けないので扱わない
+    // InitializePaging はメモリマップ全体を写すので，これに掛かるのは 1 GiB ページがない場合などに限られる
+    const uintptr_t kMappedEnd = IdentityMappedEnd();
     const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+    const auto memory_map_end = memory_map_base + memory_map.map_size;
+    auto desc_at = [](uintptr_t itr) { return reinterpret_cast<const MemoryDescriptor*>(itr); };
+
+    // 使えるメモリの終端からビットマップの大きさを決める
+    uintptr_t max_available_end = 0;
+    for (auto itr = memory_map_base; itr < memory_map_end; itr += memory_map.descriptor_size) {
+        auto desc = desc_at(itr);
+        if (!IsAvailable(static_cast<MemoryType>(desc->type))) continue;
+        max_available_end = std::max<uintptr_t>(
+            max_available_end, desc->physical_start + desc->number_of_pages * kUEFIPageSize);
+    }
+    if (max_available_end > kMappedEnd) {
+        Log(kWarn, "memory above %lu GiB is not identity-mapped and is ignored\n", kMappedEnd / 1_GiB);
+        max_available_end = kMappedEnd;
+    }
+    const size_t frame_count = max_available_end / kBytesPerFrame;
+    const size_t bitmap_frames = (BitmapMemoryManager::BitmapBytes(frame_count) + kBytesPerFrame - 1) / kBytesPerFrame;
+
+    // ビットマップ自体は，それが収まる最初の空き領域の先頭に置く
+    uintptr_t bitmap_base = 0;
+    for (auto itr = memory_map_base; itr < memory_map_end; itr += memory_map.descriptor_size) {
+        auto desc = desc_at(itr);
+        if (desc->type != MemoryType::kEfiConventionalMemory) continue;
+        const auto start = std::max<uintptr_t>(desc->physical_start, kBytesPerFrame);  // フレーム 0 は使わない
+        const auto end = std::min<uintptr_t>(desc->physical_start + desc->number_of_pages * kUEFIPageSize, kMappedEnd);
+        if (start + bitmap_frames * kBytesPerFrame <= end) {
+            bitmap_base = start;
+            break;
+        }
+    }
+    if (bitmap_base == 0) {
+        Log(kError, "no memory for the frame bitmap (%lu frames)\n", bitmap_frames);
+        exit(1);
+    }
+
+    ::memory_manager = new (memory_manager_buf) BitmapMemoryManager{
+        reinterpret_cast<BitmapMemoryManager::MapLineType*>(bitmap_base), frame_count};
+
     uintptr_t available_end = 0;
-    for (uintptr_t itr = memory_map_base;
-         itr < memory_map_base + memory_map.map_size;
-         itr += memory_map.descriptor_size) {
-        auto desc = reinterpret_cast<const MemoryDescriptor*>(itr);
+    for (auto itr = memory_map_base; itr < memory_map_end; itr += memory_map.descriptor_size) {
+        auto desc = desc_at(itr);
 
         if (available_end < desc->physical_start) {
             memory_manager->MarkAllocated(
@@ -100,10 +266,51 @@ void InitializeMemoryManager(const MemoryMap& memory_map) {
                 desc->number_of_pages * kUEFIPageSize / kBytesPerFrame);
         }
     }
-    memory_manager->SetMemoryRange(FrameID{1}, FrameID{available_end / kBytesPerFrame});
+    memory_manager->MarkAllocated(FrameID{bitmap_base / kBytesPerFrame}, bitmap_frames);
+    memory_manager->SetMemoryRange(FrameID{1}, FrameID{std::min<size_t>(available_end / kBytesPerFrame, frame_count)});
 
-    if (auto err = InitializeHeap(*memory_manager)) {
-        Log(kError, "failed to allocate pages: %s at %s:%d\n", err.Name(), err.File(), err.Line());
-        exit(1);
+    Log(kInfo, "memory manager: %lu MiB free, bitmap %lu KiB\n",
+        memory_manager->CountFreeFrames() * kBytesPerFrame / 1_MiB, bitmap_frames * kBytesPerFrame / 1_KiB);
+}
+
+WithError<FrameID> AllocateFrames(size_t num_frames) {
+    if (memory_manager == nullptr) return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    InterruptGuard interrupt_guard;
+    if (num_frames != 1) {
+        SpinLockGuard lock{memory_manager_lock};
+        return memory_manager->Allocate(num_frames);
+    }
+
+    auto& cache = CurrentFrameCache();
+    if (cache.count == 0) {
+        SpinLockGuard lock{memory_manager_lock};
+        for (; cache.count < kFrameCacheBatch; ++cache.count) {
+            auto [frame, err] = memory_manager->Allocate(1);
+            if (err) break;
+            cache.frames[cache.count] = frame.ID();
+        }
+        if (cache.count == 0) return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
     }
+    return {FrameID{cache.frames[--cache.count]}, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error FreeFrames(FrameID start_frame, size_t num_frames) {
+    InterruptGuard interrupt_guard;
+    if (num_frames != 1) {
+        SpinLockGuard lock{memory_manager_lock};
+        return memory_manager->Free(start_frame, num_frames);
+    }
+
+    auto& cache = CurrentFrameCache();
+    if (cache.count == cache.frames.size()) {
+        // 古い方 (配列の前半) を返却し，残りを前に詰める
+        SpinLockGuard lock{memory_manager_lock};
+        for (size_t i = 0; i < kFrameCacheBatch; ++i) {
+            memory_manager->Free(FrameID{cache.frames[i]}, 1);
+        }
+        std::copy(cache.frames.begin() + kFrameCacheBatch, cache.frames.end(), cache.frames.begin());
+        cache.count -= kFrameCacheBatch;
+    }
+    cache.frames[cache.count++] = start_frame.ID();
+    return MAKE_ERROR(Error::kSuccess);
 }
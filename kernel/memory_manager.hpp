@@ -33,45 +33,103 @@ static const FrameID kNullFrame{std::numeric_limits<size_t>::max()};
  * 配列 alloc_map の各ビットがフレームに対応し，0 なら空き，1 なら使用中．
  * alloc_map[n] の m ビット目が対応する物理アドレスは次の式で求まる：
  *   kFrameBytes * (n * kBitsPerMapLine + m)
+ *
+ * 空きフレームはバディシステムの要領で，2^order フレームに整列した 2^order フレームのブロックに分け，
+ * order ごとの双方向リストで管理する．リストの節はブロックの先頭フレーム自体に置く．
+ * 空きブロックの先頭フレームのビットは 0 なので，解放時はバディの先頭フレームのビットを見るだけで
+ * 結合できるか分かる．確保と解放はどちらも O(log n) で済む．
  */
 class BitmapMemoryManager {
   public:
-    /** @brief このメモリ管理クラスで扱える最大の物理メモリ量 (bytes) */
-    static const auto kMaxPhysicalMemoryBytes{128_GiB};
-    /** @brief kMaxPhysicalMemoryBytes までの物理メモリを扱うための必要なフレーム数 */
-    static const auto kFrameCount{kMaxPhysicalMemoryBytes / kBytesPerFrame};
-
     /** @brief ビットマップ配列の要素型 */
     using MapLineType = unsigned long;
     /** @brief ビットマップ配列の 1 つの要素のビット数 == フレーム数 */
     static const size_t kBitsPerMapLine{8 * sizeof(MapLineType)};
+    /** @brief 空きブロックの最大の order 2^kMaxOrder フレーム == 64 GiB */
+    static const unsigned int kMaxOrder{24};
 
-    /** @brief インスタンスを初期化 */
-    BitmapMemoryManager();
+    /** @brief frame_count 個のフレームを管理するのに必要なビットマップ配列の大きさ (bytes) */
+    static size_t BitmapBytes(size_t frame_count) {
+        return (frame_count + kBitsPerMapLine - 1) / kBitsPerMapLine * sizeof(MapLineType);
+    }
+
+    /**
+     * @brief インスタンスを初期化
+     * @param alloc_map     BitmapBytes(frame_count) バイトのビットマップ配列 全て空きに初期化される
+     * @param frame_count   管理するフレーム数 フレーム ID が frame_count 以上のフレームは扱わない
+     */
+    BitmapMemoryManager(MapLineType* alloc_map, size_t frame_count);
 
-    /** @brief 要求されたフレーム数の領域を確保して先頭のフレーム ID を返す */
+    /**
+     * @brief 要求されたフレーム数の領域を確保して先頭のフレーム ID を返す
+     * 領域は num_frames 以上の最小の 2 の冪に整列する 2 の冪に満たない分の末尾は空きに戻す
+     */
     WithError<FrameID> Allocate(size_t num_frames);
+    /** @brief 任意の範囲を解放する Allocate で確保した領域の一部だけを解放してもよい */
     Error Free(FrameID start_frame, size_t num_frames);
+    /**
+     * @brief 範囲を使用中にする SetMemoryRange より前，空きリストを作る前にだけ使える
+     * 管理するフレーム数を超える部分は無視する
+     */
     void MarkAllocated(FrameID start_frame, size_t num_frames);
 
     /**
      * @brief このメモリマネージャで扱うメモリ範囲を設定
      * この呼び出し以降, Allocate によるメモリ割り当ては設定された範囲内でのみ行われる
+     * 範囲内の空きフレームから空きリストを作るので，範囲内のメモリはアイデンティティマップされていること
      *
      * @param range_begin_  メモリ範囲の始点
      * @param range_end_    メモリ範囲の終点 最終フレームの次のフレーム
      */
     void SetMemoryRange(FrameID range_begin, FrameID range_end);
 
+    /** @brief 管理範囲内の空きフレーム数 */
+    size_t CountFreeFrames() const;
+
   private:
-    std::array<MapLineType, kFrameCount / kBitsPerMapLine> alloc_map_;
+    /** @brief 空きブロックの先頭フレームに置くリストの節 */
+    struct FreeBlock {
+        FreeBlock* prev;
+        FreeBlock* next;
+        unsigned int order;
+    };
+
+    MapLineType* const alloc_map_;
+    const size_t frame_count_;
+    /** @brief order ごとの空きブロックのリスト */
+    std::array<FreeBlock*, kMaxOrder + 1> free_lists_;
     /** @brief このメモリマネージャで扱うメモリ範囲の始点 */
     FrameID range_begin_;
     /** @brief このメモリマネージャで扱うメモリ範囲の終点 最終フレームの次のフレーム */
     FrameID range_end_;
 
     bool GetBit(FrameID frame) const;
-    void SetBit(FrameID frame, bool allocated);
+    /** @brief [begin, end) のビットをまとめて設定する 端以外はビットマップ配列の要素単位で書く */
+    void SetBits(size_t begin, size_t end, bool allocated);
+    /** @brief [begin, end) のうちビットが allocated である最初のフレーム なければ end */
+    size_t FindBit(size_t begin, size_t end, bool allocated) const;
+
+    static FreeBlock* BlockAt(size_t frame) { return reinterpret_cast<FreeBlock*>(FrameID{frame}.Frame()); }
+    static size_t FrameOf(const FreeBlock* block) { return reinterpret_cast<uintptr_t>(block) / kBytesPerFrame; }
+    /** @brief frame から始まり end を越えない，整列した最大のブロックの order */
+    static unsigned int MaxOrderAt(size_t frame, size_t end);
+    void PushBlock(size_t frame, unsigned int order);
+    void RemoveBlock(FreeBlock* block);
+    /** @brief 使用中のビットが 0 になったブロックを，バディと結合できるだけ結合してからリストに入れる */
+    void FreeBlockCoalescing(size_t frame, unsigned int order);
+    /** @brief [begin, end) を整列したブロックに分けてリストに入れる 結合はしない */
+    void PushRange(size_t begin, size_t end);
 };
 
 void InitializeMemoryManager(const MemoryMap& memory_map);
+
+/**
+ * @brief 物理フレームを num_frames 個確保する
+ * 1 フレームの確保は CPU ごとのキャッシュから行い，キャッシュが空のときだけまとめて補充する
+ */
+WithError<FrameID> AllocateFrames(size_t num_frames);
+/**
+ * @brief AllocateFrames で確保したフレームを解放する
+ * 1 フレームの解放は CPU ごとのキャッシュに戻し，キャッシュが一杯のときだけまとめて返却する
+ */
+Error FreeFrames(FrameID start_frame, size_t num_frames);
@@ -48,6 +48,14 @@ inline bool operator==(MemoryType lhs, uint32_t rhs){
     return rhs == lhs;
 }
 
+inline bool operator!=(uint32_t lhs, MemoryType rhs) {
+    return !(lhs == rhs);
+}
+
+inline bool operator!=(MemoryType lhs, uint32_t rhs) {
+    return !(lhs == rhs);
+}
+
 
 inline bool IsAvailable(MemoryType memory_type){
     return memory_type == MemoryType::kEfiBootServicesCode ||
@@ -3,5 +3,13 @@
 struct Message {
     enum Type {
         kInterruptXHCI,
+        kTimerTimeout,
     } type;
+
+    union {
+        struct {
+            unsigned long timeout;
+            int value;
+        } timer;
+    } arg;
 };
@@ -1,11 +1,13 @@
 
 #include "mouse.hpp"
 
-#include <limits>
 #include <memory>
 
+#include "console.hpp"
+#include "font.hpp"
 #include "graphics.hpp"
 #include "layer.hpp"
+#include "trace.hpp"
 #include "usb/classdriver/mouse.hpp"
 
 namespace {
@@ -37,24 +39,31 @@ namespace {
     };
 }  // namespace
 
-void DrawMouseCursor(PixelWriter* pixel_writer, Vector2D<int> position) {
-    for (int dy = 0; dy < kMouseCursorHeight; ++dy) {
-        for (int dx = 0; dx < kMouseCursorWidth; ++dx) {
-            PixelColor c;
-            switch (mouse_cursor_shape[dy][dx]) {
-                case '@':
-                    c = {0, 0, 0};
-                    break;
-                case '.':
-                    c = {255, 255, 255};
-                    break;
-                default:
-                    c = kMouseTransparentColor;
-                    break;
+namespace {
+    template <typename Writer>
+    void DrawMouseCursorImpl(Writer& writer, Vector2D<int> position) {
+        for (int dy = 0; dy < kMouseCursorHeight; ++dy) {
+            for (int dx = 0; dx < kMouseCursorWidth; ++dx) {
+                PixelColor c;
+                switch (mouse_cursor_shape[dy][dx]) {
+                    case '@':
+                        c = {0, 0, 0};
+                        break;
+                    case '.':
+                        c = {255, 255, 255};
+                        break;
+                    default:
+                        c = kMouseTransparentColor;
+                        break;
+                }
+                writer.Write(position + Vector2D<int>{dx, dy}, c);
             }
-            pixel_writer->Write(position + Vector2D<int>{dx, dy}, c);
         }
     }
+}  // namespace
+
+void DrawMouseCursor(PixelWriter* pixel_writer, Vector2D<int> position) {
+    VisitPixelWriter(*pixel_writer, [position](auto& w) { DrawMouseCursorImpl(w, position); });
 }
 
 Mouse::Mouse(unsigned int layer_id) : layer_id_{layer_id} {}
@@ -90,11 +99,31 @@ void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacem
         drag_layer_id_ = 0;
     }
 
+    // コンソールの上で右ボタンを押したまま動かすと，スクロールバックを表示する
+    const bool previous_right_pressed = previous_buttons_ & kMouseKeyRight;
+    const bool right_pressed = buttons & kMouseKeyRight;
+    if (!previous_right_pressed && right_pressed) {
+        auto layer = layer_manager->FindLayerByPosition(position_, layer_id_);
+        scrolling_console_ = layer && layer->ID() == console->LayerID();
+        scroll_remainder_ = 0;
+    } else if (previous_right_pressed && right_pressed && scrolling_console_) {
+        // 下へ動かすと古い行が見えるよう，1 文字の高さごとに 1 行ずらす
+        scroll_remainder_ += displacement_y;
+        const int lines = scroll_remainder_ / KERNEL_GLYPH_HEIGHT;
+        scroll_remainder_ -= lines * KERNEL_GLYPH_HEIGHT;
+        if (lines != 0) console->ScrollView(lines);
+    } else if (previous_right_pressed && !right_pressed) {
+        scrolling_console_ = false;
+    }
+
+    // 中ボタンのクリックでトレースを書き出す
+    if (!(previous_buttons_ & kMouseKeyMiddle) && (buttons & kMouseKeyMiddle)) DumpTrace();
+
     previous_buttons_ = buttons;
 }
 
 void InitializeMouse() {
-    auto mouse_window = std::make_shared<Window>(kMouseCursorWidth, kMouseCursorHeight, screen_config.pixel_format);
+    auto mouse_window = MakeWindow(kMouseCursorWidth, kMouseCursorHeight, screen_config.pixel_format);
     mouse_window->SetTransparentColor(kMouseTransparentColor);
     DrawMouseCursor(mouse_window.get(), {0, 0});
 
@@ -102,9 +131,11 @@ void InitializeMouse() {
                               .SetWindow(mouse_window)
                               .ID();
 
+    // カーソルは通常のレイヤーの重ね合わせから外し，カーソルプレーンに表示する
+    layer_manager->SetCursorLayer(mouse_layer_id);
+
     auto mouse = std::make_shared<Mouse>(mouse_layer_id);
     mouse->SetPosition({200, 200});
-    layer_manager->UpDown(mouse->LayerID(), std::numeric_limits<int>::max());
 
     usb::HIDMouseDriver::default_observer = [mouse](uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
         mouse->OnInterrupt(buttons, displacement_x, displacement_y);
@@ -41,6 +41,10 @@ class Mouse {
 
     unsigned int drag_layer_id_{0};
     uint8_t previous_buttons_{0};
+    /** @brief コンソール上で右ボタンを押している間 true 縦方向の移動で表示をスクロールする */
+    bool scrolling_console_{false};
+    /** @brief スクロールに使い切っていない縦方向の移動量 */
+    int scroll_remainder_{0};
 };
 
 void InitializeMouse();
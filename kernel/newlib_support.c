@@ -1,17 +1,10 @@
 #include <errno.h>
 #include <sys/types.h>
 
-caddr_t program_break, program_break_end;
-
+// malloc 一式は heap.cpp が提供するので，newlib の malloc が使う sbrk は常に失敗させる
 caddr_t sbrk(int incr) {
-    if(program_break == 0 || program_break + incr >= program_break_end) {
-        errno = ENOMEM;
-        return (caddr_t)-1;
-    }
-
-    caddr_t prev_break = program_break;
-    program_break += incr;
-    return prev_break;
+    errno = ENOMEM;
+    return (caddr_t)-1;
 }
 
 void _exit(void) {
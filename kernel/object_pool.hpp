@@ -0,0 +1,158 @@
+/**
+ * @file object_pool.hpp
+ *
+ * 固定長ブロックのオブジェクトプール
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+/**
+ * @brief BlockSize バイトのブロックを N 個持つプール
+ *
+ * 空きブロックは各ブロックの先頭に次の空きブロックへのポインタを置いた単方向リストで管理し，
+ * 確保と解放はどちらも O(1) でヒープを使わない ブロックは先頭から順に使い始めるので
+ * ブロック自体の初期化は不要で，グローバル変数としてゼロ初期化された状態でも使える
+ * ブロックの位置は変わらないので，ブロックの番号 (インデックス) を ID として使える
+ */
+template <size_t BlockSize, size_t Align, size_t N>
+class BlockPool {
+  public:
+    static const size_t kBlockSize = BlockSize;
+    static const size_t kAlign = Align;
+    static const size_t kCapacity = N;
+
+    /** @brief 空きブロックを 1 つ確保する 空きがなければ nullptr */
+    void* Allocate() {
+        Block* block = free_list_;
+        if (block) {
+            free_list_ = block->next;
+        } else if (used_ < N) {
+            block = &blocks_[used_++];
+        } else {
+            return nullptr;
+        }
+        ++count_;
+        return block->storage;
+    }
+
+    void Free(void* p) {
+        auto block = reinterpret_cast<Block*>(p);
+        block->next = free_list_;
+        free_list_ = block;
+        --count_;
+    }
+
+    /** @brief 次の Allocate が返すブロックの番号 空きがなければ N */
+    size_t NextIndex() const {
+        return free_list_ ? IndexOf(free_list_) : used_;
+    }
+
+    size_t IndexOf(const void* p) const {
+        return reinterpret_cast<const Block*>(p) - blocks_.data();
+    }
+    void* At(size_t index) { return blocks_[index].storage; }
+    bool Contains(const void* p) const {
+        const auto addr = reinterpret_cast<uintptr_t>(p);
+        return reinterpret_cast<uintptr_t>(blocks_.data()) <= addr &&
+               addr < reinterpret_cast<uintptr_t>(blocks_.data() + N);
+    }
+    /** @brief 確保中のブロック数 */
+    size_t Count() const { return count_; }
+
+  private:
+    union Block {
+        Block* next;
+        alignas(Align) unsigned char storage[BlockSize];
+    };
+
+    std::array<Block, N> blocks_;
+    Block* free_list_{nullptr};
+    /** @brief 一度でも確保したことのあるブロックの数 これより後ろのブロックは未使用 */
+    size_t used_{0};
+    size_t count_{0};
+};
+
+/**
+ * @brief T 型のオブジェクトを N 個まで保持するプール
+ *
+ * オブジェクトの番号は破棄されるまで変わらず，番号からオブジェクトを O(1) で引ける
+ */
+template <typename T, size_t N>
+class ObjectPool {
+  public:
+    /** @brief オブジェクトを生成する 空きがなければ nullptr */
+    template <typename... Args>
+    T* New(Args&&... args) {
+        void* p = pool_.Allocate();
+        if (p == nullptr) return nullptr;
+        live_[pool_.IndexOf(p)] = true;
+        return new (p) T(std::forward<Args>(args)...);
+    }
+
+    void Delete(T* obj) {
+        obj->~T();
+        live_[pool_.IndexOf(obj)] = false;
+        pool_.Free(obj);
+    }
+
+    /** @brief 次の New で生成されるオブジェクトの番号 */
+    size_t NextIndex() const { return pool_.NextIndex(); }
+    size_t IndexOf(const T* obj) const { return pool_.IndexOf(obj); }
+    /** @brief 番号 index のオブジェクト 範囲外か生成されていなければ nullptr */
+    T* At(size_t index) {
+        if (index >= N || !live_[index]) return nullptr;
+        return std::launder(reinterpret_cast<T*>(pool_.At(index)));
+    }
+    size_t Count() const { return pool_.Count(); }
+
+  private:
+    BlockPool<sizeof(T), alignof(T), N> pool_;
+    std::array<bool, N> live_{};
+};
+
+/**
+ * @brief Pool のブロックからメモリを確保するアロケータ std::allocate_shared などに渡す
+ *
+ * Pool は Allocate, Free, Contains を持ち，関数 Pool& P() がプールを返す
+ * 1 個ずつの確保だけをプールで扱い，それ以外やプールが一杯のときは通常のヒープを使う
+ */
+template <typename T, typename Pool, Pool& (*P)()>
+class PoolAllocator {
+  public:
+    using value_type = T;
+
+    PoolAllocator() = default;
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U, Pool, P>&) {}
+
+    template <typename U>
+    struct rebind {
+        using other = PoolAllocator<U, Pool, P>;
+    };
+
+    T* allocate(size_t n) {
+        if (n == 1 && sizeof(T) <= Pool::kBlockSize && alignof(T) <= Pool::kAlign) {
+            if (void* p = P().Allocate()) return static_cast<T*>(p);
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (P().Contains(p)) {
+            P().Free(p);
+        } else {
+            ::operator delete(p);
+        }
+    }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U, Pool, P>&) const { return true; }
+    template <typename U>
+    bool operator!=(const PoolAllocator<U, Pool, P>&) const { return false; }
+};
@@ -1,9 +1,12 @@
 
 #include "paging.hpp"
 
+#include <algorithm>
 #include <array>
 
 #include "asmfunc.h"
+#include "graphics.hpp"
+#include "logger.hpp"
 
 // See: https://wiki.osdev.org/Page_Tables#2_MiB_pages_2
 namespace {
@@ -11,14 +14,17 @@ namespace {
     const uint64_t kPageSize2M = 512 * kPageSize4K;  // 2^21
     const uint64_t kPageSize1G = 512 * kPageSize2M;  // 2^30
 
-    // const uint16_t kPageFlagP = 1 << 0;    // Present
-    // const uint16_t kPageFlagRW = 1 << 1;   // Read / Write
+    const uint16_t kPageFlagP = 1 << 0;    // Present
+    const uint16_t kPageFlagRW = 1 << 1;   // Read / Write
     // const uint16_t kPageFlagUS = 1 << 2;   // User / Supervisor
-    // const uint16_t kPageFlagPWT = 1 << 3;  // Write-Through
+    const uint16_t kPageFlagPWT = 1 << 3;  // Write-Through
     // const uint16_t kPageFlagPCD = 1 << 4;  // Cache Disable
     // const uint16_t kPageFlagA = 1 << 5;    // Accessed
     // const uint16_t kPageFlagAVL = 1 << 6;  // AVaiLable
-    // const uint16_t kPageFlagPS = 1 << 7;   // Page Size (0: 1 GiB, 1: 2 MiB)
+    const uint16_t kPageFlagPS = 1 << 7;   // Page Size (0: 1 GiB, 1: 2 MiB)
+
+    const uint32_t kIA32PAT = 0x277;
+    const uint64_t kMemoryTypeWC = 0x01;  // Write-Combining
 
     // 4 level paging
     // Page Map Level 4 table
@@ -27,19 +33,154 @@ namespace {
     alignas(kPageSize4K) std::array<uint64_t, 512> pdp_table;
     // Page Directory
     alignas(kPageSize4K) std::array<std::array<uint64_t, 512>, kPageDirectoryCount> page_directory;
+    // 4 KiB 単位に分割した 2 MiB ページ用の Page Table
+    // 分割するのはフレームバッファの先頭と末尾の 2 MiB ページだけなので 2 つで足りる
+    alignas(kPageSize4K) std::array<std::array<uint64_t, 512>, 2> split_page_table;
+    size_t num_split_page_table;
+
+    uint64_t identity_mapped_end;
+
+    /** @brief 1 GiB ページに対応しているなら true (CPUID.80000001H:EDX[26]) */
+    bool Is1GiBPageSupported() {
+        uint32_t a, b, c, d;
+        ReadCPUID(0x80000000, 0, &a, &b, &c, &d);
+        if (a < 0x80000001) return false;
+        ReadCPUID(0x80000001, 0, &a, &b, &c, &d);
+        return d & (1u << 26);
+    }
+
+    /**
+     * @brief PAT の 1 番目のエントリ (PWT = 1, PCD = 0, PAT = 0 のページが参照する) を Write-Combining にする
+     *
+     * @return PAT に対応していなければ false
+     */
+    bool SetupPAT() {
+        uint32_t a, b, c, d;
+        ReadCPUID(1, 0, &a, &b, &c, &d);
+        if ((d & (1u << 16)) == 0) return false;
+
+        auto pat = ReadMSR(kIA32PAT);
+        pat = (pat & ~(0xffull << 8)) | (kMemoryTypeWC << 8);
+        WriteMSR(kIA32PAT, pat);
+        return true;
+    }
+
+    /**
+     * @brief 2 MiB ページのエントリを，同じ範囲を 4 KiB ページで写す Page Table に置き換える
+     *
+     * 既に分割済みならその Page Table を返す 呼び出し側で split_page_table の残りを確かめておくこと
+     */
+    uint64_t* SplitPage(uint64_t& pd_entry) {
+        if ((pd_entry & kPageFlagPS) == 0) {
+            return reinterpret_cast<uint64_t*>(pd_entry & ~(kPageSize4K - 1));
+        }
+        auto& table = split_page_table[num_split_page_table++];
+        const uint64_t base = pd_entry & ~(kPageSize2M - 1);
+        for (int i = 0; i < 512; ++i) {
+            table[i] = (base + i * kPageSize4K) | kPageFlagP | kPageFlagRW;
+        }
+        pd_entry = reinterpret_cast<uint64_t>(&table[0]) | kPageFlagP | kPageFlagRW;
+        return &table[0];
+    }
+
+    /**
+     * @brief 物理アドレス [start, end) を Write-Combining で写すようページテーブルを書き換える
+     *
+     * 範囲に完全に含まれる 2 MiB ページはそのまま PWT を立て，端の 2 MiB ページは 4 KiB ページに分割する
+     * 分割に使う Page Table が足りなければ，どのエントリも書き換えずに false を返す
+     */
+    bool MapWriteCombining(uint64_t start, uint64_t end) {
+        start &= ~(kPageSize4K - 1);
+        end = (end + kPageSize4K - 1) & ~(kPageSize4K - 1);
+        const uint64_t first_page = start & ~(kPageSize2M - 1);
+
+        // 一部だけが範囲に含まれ，まだ分割していない 2 MiB ページの数を数える
+        size_t splits = 0;
+        for (uint64_t page = first_page; page < end; page += kPageSize2M) {
+            const auto pd_entry = page_directory[page / kPageSize1G][page % kPageSize1G / kPageSize2M];
+            const bool partial = page < start || end < page + kPageSize2M;
+            if (partial && (pd_entry & kPageFlagPS)) ++splits;
+        }
+        if (num_split_page_table + splits > split_page_table.size()) return false;
+
+        for (uint64_t page = first_page; page < end; page += kPageSize2M) {
+            auto& pd_entry = page_directory[page / kPageSize1G][page % kPageSize1G / kPageSize2M];
+            if (start <= page && page + kPageSize2M <= end) {
+                pd_entry |= kPageFlagPWT;
+                continue;
+            }
+
+            auto table = SplitPage(pd_entry);
+            for (int i = 0; i < 512; ++i) {
+                const uint64_t addr = page + i * kPageSize4K;
+                if (start <= addr && addr < end) table[i] |= kPageFlagPWT;
+            }
+        }
+        return true;
+    }
+
+    /** @brief フレームバッファを Write-Combining で写す */
+    void MapFrameBuffer() {
+        const auto start = reinterpret_cast<uint64_t>(screen_config.frame_buffer);
+        // 対応しているピクセル形式はどちらも 1 ピクセル 4 バイト
+        const auto end = start + 4ull * screen_config.pixels_per_scan_line *
+                                     screen_config.vertical_resolution;
+        if (start == 0) return;
+        if (end > kPageDirectoryCount * kPageSize1G) {
+            Log(kWarn, "frame buffer %#lx-%#lx is outside the 2 MiB-page identity map\n", start, end);
+            return;
+        }
+        if (!SetupPAT()) {
+            Log(kWarn, "PAT is not supported; frame buffer stays write-back\n");
+            return;
+        }
+
+        if (!MapWriteCombining(start, end)) {
+            Log(kWarn, "no page table left to split the frame buffer mapping; it stays write-back\n");
+            return;
+        }
+        // メモリタイプを変えた範囲の Write-Back のキャッシュラインが，後から WC で書いた内容を
+        // 上書きしないよう書き戻して破棄してから，TLB に残る古い変換を捨てる (SDM 11.12.4)
+        WriteBackInvalidateCache();
+        SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0]));
+    }
 }  // namespace
 
-void SetupIdentityPageTable() {
+void SetupIdentityPageTable(uint64_t mapped_end) {
     pml4_table[0] = reinterpret_cast<uint64_t>(&pdp_table[0]) | 0x003;
     for (int i_pdpt = 0; i_pdpt < page_directory.size(); ++i_pdpt) {
         pdp_table[i_pdpt] = reinterpret_cast<uint64_t>(&page_directory[i_pdpt]) | 0x003;
         for (int i_pd = 0; i_pd < 512; ++i_pd) {
-            page_directory[i_pdpt][i_pd] = i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x083;
+            page_directory[i_pdpt][i_pd] = (i_pdpt * kPageSize1G + i_pd * kPageSize2M) | 0x083;
         }
     }
+    identity_mapped_end = page_directory.size() * kPageSize1G;
+
+    // ページディレクトリを用意していない範囲は 1 GiB ページで写す 1 つの PDP テーブルで写せる 512 GiB まで
+    if (mapped_end > identity_mapped_end && Is1GiBPageSupported()) {
+        const uint64_t pdpt_end = std::min<uint64_t>((mapped_end + kPageSize1G - 1) / kPageSize1G, pdp_table.size());
+        for (uint64_t i_pdpt = page_directory.size(); i_pdpt < pdpt_end; ++i_pdpt) {
+            pdp_table[i_pdpt] = (i_pdpt * kPageSize1G) | 0x083;
+        }
+        identity_mapped_end = pdpt_end * kPageSize1G;
+    }
+    if (mapped_end > identity_mapped_end) {
+        Log(kWarn, "physical memory above %lu GiB is not identity-mapped\n", identity_mapped_end / kPageSize1G);
+    }
     SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0]));
 }
 
-void InitializePaging() {
-    SetupIdentityPageTable();
+uint64_t IdentityMappedEnd() {
+    return identity_mapped_end;
+}
+
+void InitializePaging(const MemoryMap& memory_map) {
+    const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+    uint64_t mapped_end = 0;
+    for (auto itr = memory_map_base; itr < memory_map_base + memory_map.map_size; itr += memory_map.descriptor_size) {
+        auto desc = reinterpret_cast<const MemoryDescriptor*>(itr);
+        mapped_end = std::max<uint64_t>(mapped_end, desc->physical_start + desc->number_of_pages * kUEFIPageSize);
+    }
+    SetupIdentityPageTable(mapped_end);
+    MapFrameBuffer();
 }
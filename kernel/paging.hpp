@@ -1,20 +1,35 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
+
+#include "memory_map.hpp"
 
 /**
  * @brief 静的に確保するページディレクトリの個数
  *
  * SetupIdentityPageMap で使用される
- * kPageDirectoryCount * 1 GiB の仮想アドレスがマッピングされる
+ * 先頭 kPageDirectoryCount * 1 GiB の仮想アドレスが 2 MiB ページでマッピングされる
  * kPDC [page directories] * 512 [page tables / page directory] * 2 [MiB / page table] = kPDC [GiB]
  */
 const size_t kPageDirectoryCount = 64;
 
 /**
  * @brief 仮想アドレス = 物理アドレスとなるようにページテーブルを設定
+ *
+ * 先頭 kPageDirectoryCount GiB は 2 MiB ページで写す
+ * それより上の mapped_end までは，CPU が対応していれば 1 GiB ページで写す (最大 512 GiB)
  * 最終的に CR3 レジスタが正しく設定されたページテーブルを指すようになる
  */
-void SetupIdentityPageTable();
+void SetupIdentityPageTable(uint64_t mapped_end);
+
+/** @brief アイデンティティマップされている物理アドレスの終端 */
+uint64_t IdentityMappedEnd();
 
-void InitializePaging();
+/**
+ * @brief メモリマップに現れる最も高いアドレスまでを覆うアイデンティティマップを設定し，
+ *        フレームバッファを Write-Combining で写す
+ *
+ * InitializeGraphics の後に呼ぶこと
+ */
+void InitializePaging(const MemoryMap& memory_map);
@@ -1,12 +1,18 @@
-
-
 #pragma once
 
 #include <array>
+#include <atomic>
 #include <cstdint>
 
 #include "error.hpp"
 
+/**
+ * @brief 固定長の配列上に作るキュー
+ *
+ * 書き込み側と読み出し側がそれぞれ 1 つずつなら，ロックも割り込み禁止もなしに並行して使える
+ * (割り込みハンドラが Push し，メインループが Pop するなど) 書き込み側が複数ある場合は
+ * 割り込みハンドラ同士のように互いに割り込まないことが前提 メモリは確保しない
+ */
 template <typename T>
 class ArrayQueue {
   public:
@@ -14,21 +20,29 @@ class ArrayQueue {
     ArrayQueue(std::array<T, N>& buf);
     ArrayQueue(T* buf, size_t size);
 
+    /** @brief 書き込み側 満杯なら value を捨てて Dropped を加算し kFull を返す */
     Error Push(const T& value);
+    /** @brief 読み出し側 */
     Error Pop();
+    /** @brief 読み出し側 最大 max 個の要素をまとめて out に取り出し，取り出した数を返す */
+    size_t PopBatch(T* out, size_t max);
 
     size_t Count() const;
     size_t Capacity() const;
+    /** @brief 読み出し側 */
     const T& Front() const;
+    /** @brief 満杯のため捨てられた要素の累計数 */
+    size_t Dropped() const;
 
   private:
     T* data_;
-    size_t read_pos_, write_pos_, count_;
     /*
-     * read_pos_ points to an element to be read
-     * write_pos_ points to a blank position
-     * count_ is the number of elements available
+     * read_pos_ is the number of elements read so far
+     * write_pos_ is the number of elements written so far
+     * both only increase; the slot index is pos % capacity_
      */
+    std::atomic<size_t> read_pos_, write_pos_;
+    std::atomic<size_t> dropped_;
     const size_t capacity_;
 };
 
@@ -38,38 +52,56 @@ ArrayQueue<T>::ArrayQueue(std::array<T, N>& buf) : ArrayQueue(buf.data(), N) {}
 
 template <typename T>
 ArrayQueue<T>::ArrayQueue(T* buf, size_t size)
-    : data_{buf}, read_pos_{0}, write_pos_{0}, count_{0}, capacity_{size} {}
+    : data_{buf}, read_pos_{0}, write_pos_{0}, dropped_{0}, capacity_{size} {}
 
 template<typename T>
 Error ArrayQueue<T>::Push(const T& value){
-    if (count_ == capacity_) return MAKE_ERROR(Error::kFull);
-    
-    data_[write_pos_] = value;
-    ++count_;
-    ++write_pos_;
-    if (write_pos_ == capacity_) write_pos_ = 0;
+    const auto write_pos = write_pos_.load(std::memory_order_relaxed);
+    if (write_pos - read_pos_.load(std::memory_order_acquire) == capacity_) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return MAKE_ERROR(Error::kFull);
+    }
+
+    data_[write_pos % capacity_] = value;
+    write_pos_.store(write_pos + 1, std::memory_order_release);
 
     return MAKE_ERROR(Error::kSuccess);
 }
 
 template<typename T>
 Error ArrayQueue<T>::Pop(){
-    if (count_ == 0) return MAKE_ERROR(Error::kEmpty);
-    
-    --count_;
-    ++read_pos_;
-    if (read_pos_ == capacity_) read_pos_ = 0;
+    const auto read_pos = read_pos_.load(std::memory_order_relaxed);
+    if (write_pos_.load(std::memory_order_acquire) == read_pos) return MAKE_ERROR(Error::kEmpty);
+
+    read_pos_.store(read_pos + 1, std::memory_order_release);
 
     return MAKE_ERROR(Error::kSuccess);
 }
 
+template <typename T>
+size_t ArrayQueue<T>::PopBatch(T* out, size_t max) {
+    const auto read_pos = read_pos_.load(std::memory_order_relaxed);
+    const auto available = write_pos_.load(std::memory_order_acquire) - read_pos;
+    const auto n = available < max ? available : max;
+
+    for (size_t i = 0; i < n; ++i) out[i] = data_[(read_pos + i) % capacity_];
+    read_pos_.store(read_pos + n, std::memory_order_release);
+
+    return n;
+}
+
 template <typename T>
 const T& ArrayQueue<T>::Front() const {
-    return data_[read_pos_];
+    return data_[read_pos_.load(std::memory_order_relaxed) % capacity_];
 }
 
 template <typename T>
-size_t ArrayQueue<T>::Count() const { return count_; }
+size_t ArrayQueue<T>::Count() const {
+    return write_pos_.load(std::memory_order_acquire) - read_pos_.load(std::memory_order_acquire);
+}
 
 template <typename T>
 size_t ArrayQueue<T>::Capacity() const { return capacity_; }
+
+template <typename T>
+size_t ArrayQueue<T>::Dropped() const { return dropped_.load(std::memory_order_relaxed); }
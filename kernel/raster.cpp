@@ -0,0 +1,122 @@
+/**
+ * @file raster.cpp
+ *
+ * スパン単位の描画カーネルの実装．
+ */
+
+#include "raster.hpp"
+
+#include <immintrin.h>
+
+#include "asmfunc.h"
+
+namespace {
+    void FillSpan32SSE2(uint32_t* dst, uint32_t value, size_t count) {
+        const __m128i v = _mm_set1_epi32(value);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), v);
+        }
+        for (; i < count; ++i) dst[i] = value;
+    }
+
+    void CopySpan32SSE2(uint32_t* dst, const uint32_t* src, size_t count) {
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), s);
+        }
+        for (; i < count; ++i) dst[i] = src[i];
+    }
+
+    void CopySpan32ColorKeySSE2(uint32_t* dst, const uint32_t* src, size_t count, uint32_t key) {
+        const __m128i color_mask = _mm_set1_epi32(kPixelColorMask);
+        const __m128i k = _mm_set1_epi32(key & kPixelColorMask);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+            // 透過色のレーンは dst を，それ以外は src を選ぶ
+            const __m128i transparent = _mm_cmpeq_epi32(_mm_and_si128(s, color_mask), k);
+            const __m128i blended = _mm_or_si128(_mm_and_si128(transparent, d),
+                                                 _mm_andnot_si128(transparent, s));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), blended);
+        }
+        for (; i < count; ++i) {
+            if ((src[i] & kPixelColorMask) != (key & kPixelColorMask)) dst[i] = src[i];
+        }
+    }
+
+    __attribute__((target("avx2")))
+    void FillSpan32AVX2(uint32_t* dst, uint32_t value, size_t count) {
+        const __m256i v = _mm256_set1_epi32(value);
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), v);
+        }
+        for (; i < count; ++i) dst[i] = value;
+    }
+
+    __attribute__((target("avx2")))
+    void CopySpan32AVX2(uint32_t* dst, const uint32_t* src, size_t count) {
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), s);
+        }
+        for (; i < count; ++i) dst[i] = src[i];
+    }
+
+    __attribute__((target("avx2")))
+    void CopySpan32ColorKeyAVX2(uint32_t* dst, const uint32_t* src, size_t count, uint32_t key) {
+        const __m256i color_mask = _mm256_set1_epi32(kPixelColorMask);
+        const __m256i k = _mm256_set1_epi32(key & kPixelColorMask);
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+            const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+            const __m256i transparent = _mm256_cmpeq_epi32(_mm256_and_si256(s, color_mask), k);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                                _mm256_blendv_epi8(s, d, transparent));
+        }
+        for (; i < count; ++i) {
+            if ((src[i] & kPixelColorMask) != (key & kPixelColorMask)) dst[i] = src[i];
+        }
+    }
+
+    const char* kernel_name = "SSE2";
+
+    /** @brief AVX2 命令が使用可能か (CPU が対応し，かつ YMM レジスタの保存が有効か) */
+    bool AVX2Available() {
+        uint32_t a, b, c, d;
+        ReadCPUID(0, 0, &a, &b, &c, &d);
+        const uint32_t max_leaf = a;
+        if (max_leaf < 7) return false;
+
+        ReadCPUID(1, 0, &a, &b, &c, &d);
+        const bool osxsave = (c >> 27) & 1u;
+        const bool avx = (c >> 28) & 1u;
+        if (!osxsave || !avx) return false;
+        // XCR0 の bit 1 (SSE), bit 2 (AVX) が立っていなければ YMM レジスタは使えない
+        if ((GetXCR0() & 0b110) != 0b110) return false;
+
+        ReadCPUID(7, 0, &a, &b, &c, &d);
+        return (b >> 5) & 1u;
+    }
+}  // namespace
+
+// SSE2 は x86-64 では常に使用可能なので初期値とする
+void (*FillSpan32)(uint32_t*, uint32_t, size_t) = FillSpan32SSE2;
+void (*CopySpan32)(uint32_t*, const uint32_t*, size_t) = CopySpan32SSE2;
+void (*CopySpan32ColorKey)(uint32_t*, const uint32_t*, size_t, uint32_t) = CopySpan32ColorKeySSE2;
+
+void InitializeRaster() {
+    if (AVX2Available()) {
+        FillSpan32 = FillSpan32AVX2;
+        CopySpan32 = CopySpan32AVX2;
+        CopySpan32ColorKey = CopySpan32ColorKeyAVX2;
+        kernel_name = "AVX2";
+    }
+}
+
+const char* RasterKernelName() { return kernel_name; }
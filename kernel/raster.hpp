@@ -0,0 +1,30 @@
+/**
+ * @file raster.hpp
+ *
+ * 32 ビット/ピクセルの画素列 (スパン) を処理する描画カーネルを集めたファイル．
+ * SSE2 版と AVX2 版があり，InitializeRaster で CPUID を見て切り替える．
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/** @brief dst から count ピクセルを value で埋める */
+extern void (*FillSpan32)(uint32_t* dst, uint32_t value, size_t count);
+/** @brief src から dst へ count ピクセルをコピーする 領域は重なってはならない */
+extern void (*CopySpan32)(uint32_t* dst, const uint32_t* src, size_t count);
+/**
+ * @brief src から dst へ count ピクセルをコピーする ただし色が key のピクセルは書き込まない
+ *
+ * 比較は下位 24 ビット (色成分) のみで行い，予約バイトは無視する
+ */
+extern void (*CopySpan32ColorKey)(uint32_t* dst, const uint32_t* src, size_t count, uint32_t key);
+
+/** @brief 色比較の対象となるビット (予約バイトを除いた色成分) */
+const uint32_t kPixelColorMask = 0x00ffffffu;
+
+/** @brief CPU の対応状況を調べ，使用する描画カーネルを選択する */
+void InitializeRaster();
+/** @brief 選択されている描画カーネルの名前を返す */
+const char* RasterKernelName();
@@ -0,0 +1,37 @@
+/**
+ * @file spinlock.hpp
+ * @brief CPU 間の排他制御に使うスピンロック
+ */
+
+#pragma once
+
+#include <atomic>
+
+/**
+ * @brief 取得できるまで待ち続けるロック
+ * 割り込みハンドラと共有する場合は，同じ CPU でのデッドロックを避けるため InterruptGuard と併用する
+ */
+class SpinLock {
+  public:
+    void Lock() {
+        while (locked_.exchange(true, std::memory_order_acquire)) {
+            while (locked_.load(std::memory_order_relaxed)) __builtin_ia32_pause();
+        }
+    }
+    void Unlock() { locked_.store(false, std::memory_order_release); }
+
+  private:
+    std::atomic<bool> locked_{false};
+};
+
+/** @brief スコープの間だけロックを取る */
+class SpinLockGuard {
+  public:
+    SpinLockGuard(SpinLock& lock) : lock_{lock} { lock_.Lock(); }
+    ~SpinLockGuard() { lock_.Unlock(); }
+    SpinLockGuard(const SpinLockGuard&) = delete;
+    SpinLockGuard& operator=(const SpinLockGuard&) = delete;
+
+  private:
+    SpinLock& lock_;
+};
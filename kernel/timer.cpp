@@ -1,5 +1,10 @@
 #include "timer.hpp"
 
+#include <algorithm>
+
+#include "asmfunc.h"
+#include "interrupt.hpp"
+
 namespace {
     // LVT timer
     const uint32_t LAPIC_TIMER_ADDR_LVT_TIMER = 0xfee00320;
@@ -15,9 +20,52 @@ namespace {
     volatile uint32_t& initial_count = *reinterpret_cast<uint32_t*>(LAPIC_TIMER_ADDR_INIT_COUNT);
     volatile uint32_t& current_count = *reinterpret_cast<uint32_t*>(LAPIC_TIMER_ADDR_CURRENT_COUNT);
     volatile uint32_t& divide_config = *reinterpret_cast<uint32_t*>(LAPIC_TIMER_ADDR_DIV_CONFIG);
+
+    // PIT (8254) channel 2 is gated by bit 0 of port 0x61 and its output can be read at bit 5
+    const uint16_t kPITChannel2 = 0x42;
+    const uint16_t kPITCommand = 0x43;
+    const uint16_t kPITGate = 0x61;
+    const unsigned long kPITFreq = 1193182;
+    const unsigned long kCalibrationMillis = 50;
+
+    const uint32_t kIA32TSCDeadline = 0x6e0;
+
+    bool invariant_tsc;
+    bool tsc_deadline;
+    /** @brief MonotonicNanos の基準となる TSC の値 */
+    uint64_t tsc_base;
+    /** @brief TSC のカウント数に掛けて 2^32 で割るとナノ秒になる係数 */
+    uint64_t tsc_to_nanos_mult;
+    /** @brief 1 ティックあたりの TSC のカウント数と，次のティックの TSC の期限 */
+    uint64_t tsc_per_tick;
+    uint64_t next_tsc_deadline;
+
+    void DetectTSCFeatures() {
+        uint32_t a, b, c, d;
+        ReadCPUID(0x1, 0, &a, &b, &c, &d);
+        tsc_deadline = c & (1u << 24);
+        ReadCPUID(0x80000000, 0, &a, &b, &c, &d);
+        if (a >= 0x80000007) {
+            ReadCPUID(0x80000007, 0, &a, &b, &c, &d);
+            invariant_tsc = d & (1u << 8);
+        }
+    }
+
+    /** @brief PIT のチャンネル 2 を使って count カウント分 (1 / kPITFreq 秒単位) 待つ */
+    void WaitPIT(uint16_t count) {
+        // ゲートを有効にし，スピーカーへの出力は切る
+        IoOut8(kPITGate, (IoIn8(kPITGate) & ~0x02) | 0x01);
+        IoOut8(kPITCommand, 0b10110000);  // channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+        IoOut8(kPITChannel2, count & 0xff);
+        IoOut8(kPITChannel2, count >> 8);
+        // カウントが 0 になると出力が 1 になる
+        while ((IoIn8(kPITGate) & 0x20) == 0);
+    }
 }  // namespace
 
-void InitializeLAPICTimer() {
+void InitializeLAPICTimer(ArrayQueue<Message>& queue) {
+    timer_manager = new TimerManager{queue};
+
     // div config bit 3, 1, 0 represents the division ratio (p.227)
     divide_config = 0b1011;          // divide 1:1
     /**
@@ -27,9 +75,45 @@ void InitializeLAPICTimer() {
      * 0:7      | Vector            | interrupt vector number
      * 12       | Delivery Status   | interrupt delivery status (0=empty, 1=waiting for delivery)
      * 16       | Mask              | interrupt mask (0=send interrupt, 1=don't interrupt)
-     * 17:18    | Timer Mode        | timer function mode (0=oneshot, 1=periodic)
+     * 17:18    | Timer Mode        | timer function mode (0=oneshot, 1=periodic, 2=TSC-deadline)
      */
-    lvt_timer = (0b001 << 16) | 32;  // masked, oneshot
+    lvt_timer = (0b001 << 16);  // masked, oneshot
+
+    // PIT で kCalibrationMillis ミリ秒を計り，その間に進んだカウントから周波数を求める
+    StartLAPICTimer();
+    WaitPIT(kPITFreq * kCalibrationMillis / 1000);
+    const auto elapsed = LAPICTimerElapsed();
+    StopLAPICTimer();
+    lapic_timer_freq = static_cast<unsigned long>(elapsed) * 1000 / kCalibrationMillis;
+
+    // 測定した LAPIC タイマーで同じ時間を計り，その間に進んだ TSC から TSC の周波数を求める
+    DetectTSCFeatures();
+    const uint32_t lapic_count = lapic_timer_freq * kCalibrationMillis / 1000;
+    StartLAPICTimer();
+    const auto tsc_start = ReadTSC();
+    while (LAPICTimerElapsed() < lapic_count);
+    const auto tsc_end = ReadTSC();
+    const auto lapic_elapsed = LAPICTimerElapsed();
+    StopLAPICTimer();
+    // 128 ビットの除算はランタイムライブラリ (__udivti3) を要するので，商と余りに分けて 64 ビットで計算する
+    // 余りは 32 ビットのカウンタ値未満，周波数も 2^32 Hz 未満なので積はあふれない
+    const uint64_t tsc_delta = tsc_end - tsc_start;
+    tsc_freq = tsc_delta / lapic_elapsed * lapic_timer_freq +
+               tsc_delta % lapic_elapsed * lapic_timer_freq / lapic_elapsed;
+    tsc_to_nanos_mult = (1000000000ul << 32) / tsc_freq;
+    tsc_base = ReadTSC();
+
+    if (tsc_deadline) {
+        tsc_per_tick = tsc_freq / kTimerFreq;
+        lvt_timer = (0b100 << 16) | InterruptVector::kLAPICTimer;  // not masked, TSC-deadline
+        // LVT の書き込みより後に期限が書き込まれるようにする (SDM 10.5.4.1)
+        __asm__ volatile("mfence" : : : "memory");
+        next_tsc_deadline = ReadTSC() + tsc_per_tick;
+        WriteMSR(kIA32TSCDeadline, next_tsc_deadline);
+    } else {
+        lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer;  // not masked, periodic
+        initial_count = lapic_timer_freq / kTimerFreq;
+    }
 }
 
 void StartLAPICTimer() {
@@ -47,4 +131,115 @@ uint32_t LAPICTimerElapsed() {
 void StopLAPICTimer() {
     // write zero to stop the timer
     initial_count = 0;
-}
\ No newline at end of file
+}
+
+unsigned long lapic_timer_freq;
+unsigned long tsc_freq;
+
+bool IsInvariantTSC() {
+    return invariant_tsc;
+}
+
+bool IsTSCDeadlineSupported() {
+    return tsc_deadline;
+}
+
+uint64_t TSCToNanos(uint64_t tsc_delta) {
+    return static_cast<unsigned __int128>(tsc_delta) * tsc_to_nanos_mult >> 32;
+}
+
+uint64_t MonotonicNanos() {
+    if (invariant_tsc) return TSCToNanos(ReadTSC() - tsc_base);
+    return timer_manager->CurrentTick() * (1000000000ul / kTimerFreq);
+}
+
+Timer::Timer() : prev_{nullptr}, next_{nullptr}, timeout_{0}, value_{0} {}
+
+TimerManager::TimerManager(ArrayQueue<Message>& queue) : tick_{0}, msg_queue_{queue} {
+    for (auto& level : wheel_) {
+        for (auto& head : level) head.prev_ = head.next_ = &head;
+    }
+}
+
+void TimerManager::Add(Timer& timer, unsigned long timeout, int value) {
+    InterruptGuard guard;
+    if (timer.Pending()) Remove(timer);
+    // 過ぎた時刻は次のティックで扱う
+    timer.timeout_ = std::max(timeout, tick_ + 1);
+    timer.value_ = value;
+    Insert(timer);
+}
+
+void TimerManager::Cancel(Timer& timer) {
+    InterruptGuard guard;
+    if (timer.Pending()) Remove(timer);
+}
+
+void TimerManager::Tick() {
+    const auto tick = ++tick_;
+
+    // 段 0 が 1 周したら上の段のスロットを下ろしてくる 上の段も 1 周していればさらに上から
+    for (int level = 1; level < kLevels; ++level) {
+        const auto shift = kSlotBits * level;
+        if (tick & ((1ul << shift) - 1)) break;
+        Cascade(level, (tick >> shift) & (kSlots - 1));
+    }
+
+    auto& head = wheel_[0][tick & (kSlots - 1)];
+    while (head.next_ != &head) {
+        auto& timer = *head.next_;
+        Remove(timer);
+        Message msg{Message::kTimerTimeout};
+        msg.arg.timer.timeout = timer.timeout_;
+        msg.arg.timer.value = timer.value_;
+        msg_queue_.Push(msg);
+    }
+}
+
+void TimerManager::Insert(Timer& timer) {
+    // 登録できる最も遠い時刻に切り詰める 切り詰めたタイマーは早めにタイムアウトする
+    const unsigned long kMaxDelta = (1ul << (kSlotBits * kLevels)) - 1;
+    if (timer.timeout_ - tick_ > kMaxDelta) timer.timeout_ = tick_ + kMaxDelta;
+
+    const auto delta = timer.timeout_ - tick_;
+    int level = 0;
+    while (level < kLevels - 1 && delta >= (1ul << (kSlotBits * (level + 1)))) ++level;
+    auto& head = wheel_[level][(timer.timeout_ >> (kSlotBits * level)) & (kSlots - 1)];
+
+    timer.prev_ = head.prev_;
+    timer.next_ = &head;
+    head.prev_->next_ = &timer;
+    head.prev_ = &timer;
+}
+
+void TimerManager::Remove(Timer& timer) {
+    timer.prev_->next_ = timer.next_;
+    timer.next_->prev_ = timer.prev_;
+    timer.prev_ = timer.next_ = nullptr;
+}
+
+void TimerManager::Cascade(int level, int index) {
+    auto& head = wheel_[level][index];
+    // リストを切り離してから 1 つずつ入れ直す 入れ直し先が同じスロットになることはない
+    auto timer = head.next_;
+    head.prev_->next_ = nullptr;
+    head.prev_ = head.next_ = &head;
+    while (timer && timer != &head) {
+        auto next = timer->next_;
+        Insert(*timer);
+        timer = next;
+    }
+}
+
+TimerManager* timer_manager;
+
+void LAPICTimerOnInterrupt() {
+    if (tsc_deadline) {
+        // 期限の基準を前回の期限にすることで，割り込みの遅れがティックの周期に積み重ならないようにする
+        next_tsc_deadline += tsc_per_tick;
+        const auto now = ReadTSC();
+        if (next_tsc_deadline <= now) next_tsc_deadline = now + tsc_per_tick;
+        WriteMSR(kIA32TSCDeadline, next_tsc_deadline);
+    }
+    timer_manager->Tick();
+}
@@ -1,8 +1,99 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
 
-void InitializeLAPICTimer();
+#include "message.hpp"
+#include "queue.hpp"
+
+/**
+ * @brief PIT で LAPIC タイマーの周波数を，LAPIC タイマーで TSC の周波数を測定し，kTimerFreq Hz のティック割り込みを開始する
+ * TSC-deadline モードが使えればティックは TSC の期限で 1 回ずつ発生させ，使えなければ LAPIC タイマーの周期モードを使う
+ * タイムアウトしたタイマーのメッセージは queue に送られる
+ */
+void InitializeLAPICTimer(ArrayQueue<Message>& queue);
+/** @brief LAPIC タイマーで時間計測を始める 周期割り込みとは同時に使えない */
 void StartLAPICTimer();
 uint32_t LAPICTimerElapsed();
 void StopLAPICTimer();
+
+/** @brief 周期割り込みの周波数 [Hz] 1 ティックは 1 / kTimerFreq 秒 */
+const int kTimerFreq = 100;
+/** @brief 測定した LAPIC タイマーの周波数 (分周比 1:1) [Hz] */
+extern unsigned long lapic_timer_freq;
+/** @brief 測定した TSC の周波数 [Hz] */
+extern unsigned long tsc_freq;
+
+/** @brief TSC が電源状態によらず一定の速さで進む (invariant TSC) なら true */
+bool IsInvariantTSC();
+/** @brief LAPIC タイマーの TSC-deadline モードが使えるなら true */
+bool IsTSCDeadlineSupported();
+
+/** @brief TSC のカウント数をナノ秒に換算する */
+uint64_t TSCToNanos(uint64_t tsc_delta);
+/**
+ * @brief 起動時からの経過時間 [ns] 単調増加する
+ * invariant TSC なら TSC から求め，そうでなければティック単位の精度になる
+ */
+uint64_t MonotonicNanos();
+
+/**
+ * @brief タイマーホイールに登録するタイマー
+ * 呼び出し側が所有し，登録中は破棄してはならない メモリは確保しない
+ */
+class Timer {
+  public:
+    Timer();
+    /** @brief タイマーホイールに登録されていてまだタイムアウトしていないなら true */
+    bool Pending() const { return next_ != nullptr; }
+
+  private:
+    friend class TimerManager;
+    Timer* prev_;
+    Timer* next_;
+    unsigned long timeout_;
+    int value_;
+};
+
+/**
+ * @brief 階層化タイマーホイール
+ *
+ * 64 スロットの車輪を 4 段重ね，段 l のスロットは 64^l ティック分の幅を持つ
+ * 登録と取り消しは O(1) で，上の段のスロットはその時刻が来たときに下の段へ振り分け直される
+ */
+class TimerManager {
+  public:
+    TimerManager(ArrayQueue<Message>& queue);
+    /**
+     * @brief timeout ティック目にタイムアウトするようタイマーを登録する
+     * タイムアウトすると kTimerTimeout メッセージ (arg.timer に timeout と value) がキューに送られる
+     * 登録済みのタイマーを渡すと登録し直す
+     */
+    void Add(Timer& timer, unsigned long timeout, int value);
+    /** @brief タイマーの登録を取り消す 登録されていなければ何もしない */
+    void Cancel(Timer& timer);
+    /** @brief 1 ティック進め，タイムアウトしたタイマーのメッセージを送る 割り込みハンドラから呼ぶ */
+    void Tick();
+    unsigned long CurrentTick() const { return tick_; }
+
+  private:
+    static const int kLevels = 4;
+    static const int kSlotBits = 6;
+    static const int kSlots = 1 << kSlotBits;
+
+    /** @brief タイマーを timeout_ に応じたスロットに入れる 割り込みを禁止して呼ぶこと */
+    void Insert(Timer& timer);
+    void Remove(Timer& timer);
+    /** @brief 段 level のスロット index にあるタイマーを全て下の段へ振り分け直す */
+    void Cascade(int level, int index);
+
+    volatile unsigned long tick_;
+    /** @brief 各スロットの循環リストの番兵 */
+    std::array<std::array<Timer, kSlots>, kLevels> wheel_;
+    ArrayQueue<Message>& msg_queue_;
+};
+
+extern TimerManager* timer_manager;
+
+/** @brief LAPIC タイマー割り込みの処理 */
+void LAPICTimerOnInterrupt();
@@ -0,0 +1,96 @@
+/**
+ * @file trace.cpp
+ *
+ * TSC のタイムスタンプ付きでイベントをバイナリのまま記録するトレース機構
+ */
+
+#include "trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+
+#include "asmfunc.h"
+#include "logger.hpp"
+#include "timer.hpp"
+
+namespace {
+    /** @brief トレースの 1 レコード */
+    struct TraceRecord {
+        /** @brief 書き込み完了時に記録番号 + 1 が入る 書き込み途中は 0 */
+        std::atomic<uint64_t> seq;
+        uint64_t tsc;
+        TraceEvent event;
+        uint64_t args[3];
+    };
+
+    const size_t kTraceRecords = 4096;
+    TraceRecord trace_records[kTraceRecords];
+    /** @brief これまでに予約された記録番号の数 */
+    std::atomic<uint64_t> trace_next{0};
+    std::atomic<bool> trace_enabled{false};
+
+    const char* const kTraceEventNames[] = {
+        "none",
+        "xhci.int",
+        "xhci.event+",
+        "xhci.event-",
+        "layer.draw",
+        "layer.draw_id",
+        "layer.flush+",
+        "layer.flush-",
+        "mem.alloc",
+    };
+    static_assert(sizeof(kTraceEventNames) / sizeof(kTraceEventNames[0]) ==
+                  static_cast<size_t>(TraceEvent::kEventCount));
+
+    const char* TraceEventName(TraceEvent event) {
+        const auto i = static_cast<size_t>(event);
+        return i < static_cast<size_t>(TraceEvent::kEventCount) ? kTraceEventNames[i] : "unknown";
+    }
+}
+
+void Trace(TraceEvent event, uint64_t arg0, uint64_t arg1, uint64_t arg2) {
+    if (!trace_enabled.load(std::memory_order_relaxed)) return;
+    const auto n = trace_next.fetch_add(1, std::memory_order_relaxed);
+    auto& rec = trace_records[n % kTraceRecords];
+    rec.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    rec.tsc = ReadTSC();
+    rec.event = event;
+    rec.args[0] = arg0;
+    rec.args[1] = arg1;
+    rec.args[2] = arg2;
+    rec.seq.store(n + 1, std::memory_order_release);
+}
+
+void SetTraceEnabled(bool enabled) {
+    trace_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+void DumpTrace(size_t max_records) {
+    const auto next = trace_next.load(std::memory_order_acquire);
+    size_t count = std::min<uint64_t>({next, kTraceRecords, max_records});
+
+    char s[128];
+    sprintf(s, "trace: %lu records (showing %lu)\n", next, count);
+    LogString(s);
+
+    uint64_t prev_tsc = 0;
+    for (uint64_t n = next - count; n < next; ++n) {
+        const auto& slot = trace_records[n % kTraceRecords];
+        if (slot.seq.load(std::memory_order_acquire) != n + 1) continue;
+        const uint64_t tsc = slot.tsc;
+        const TraceEvent event = slot.event;
+        const uint64_t args[3] = {slot.args[0], slot.args[1], slot.args[2]};
+        // 読み出し中に上書きされていたら捨てる
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != n + 1) continue;
+
+        const uint64_t delta = prev_tsc ? TSCToNanos(tsc - prev_tsc) : 0;
+        prev_tsc = tsc;
+        sprintf(s, "%016lx +%luns %s %lx %lx %lx\n", tsc, delta, TraceEventName(event),
+                args[0], args[1], args[2]);
+        LogString(s);
+    }
+}
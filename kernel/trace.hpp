@@ -0,0 +1,39 @@
+/**
+ * @file trace.hpp
+ *
+ * TSC のタイムスタンプ付きでイベントをバイナリのまま記録するトレース機構
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+enum class TraceEvent : uint32_t {
+    kNone,
+    kXHCIInterrupt,          // 引数なし
+    kXHCIProcessEventBegin,  // arg0: TRB 種別
+    kXHCIProcessEventEnd,    // arg0: TRB 種別, arg1: エラーコード
+    kLayerDrawArea,          // arg0: 領域の位置, arg1: 領域の大きさ (それぞれ上位 32 ビットが x, 下位 32 ビットが y)
+    kLayerDrawID,            // arg0: レイヤー ID, arg1, arg2: 一部だけ描く場合はウィンドウ座標系での位置と大きさ
+    kLayerFlushBegin,        // arg0: 再合成する領域の数, arg1: 転送だけする領域の数
+    kLayerFlushEnd,          // 引数なし
+    kMemoryAllocate,         // arg0: 要求フレーム数, arg1: 確保したフレーム ID, arg2: エラーコード
+    kEventCount,
+};
+
+/**
+ * @brief トレースイベントをリングバッファに記録する
+ * ロックを取らず書式化もしないので割り込みハンドラからも呼び出せる
+ * リングバッファが一杯になると最も古いレコードから上書きされる
+ */
+void Trace(TraceEvent event, uint64_t arg0 = 0, uint64_t arg1 = 0, uint64_t arg2 = 0);
+
+/** @brief トレースの記録を有効にするか設定する 初期状態では無効 */
+void SetTraceEnabled(bool enabled);
+
+/**
+ * @brief リングバッファに残っているレコードを古い順に最大 max_records 個デコードしてログに書き出す
+ * 各レコードには直前のレコードからの経過時間 [ns] も表示する
+ */
+void DumpTrace(size_t max_records = 64);
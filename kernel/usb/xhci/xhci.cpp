@@ -4,6 +4,7 @@
 #include "logger.hpp"
 #include "pci.hpp"
 #include "interrupt.hpp"
+#include "trace.hpp"
 #include "usb/setupdata.hpp"
 #include "usb/device.hpp"
 #include "usb/descriptor.hpp"
@@ -515,6 +516,8 @@ namespace usb::xhci {
 
     Error err = MAKE_ERROR(Error::kNotImplemented);
     auto event_trb = xhc.PrimaryEventRing()->Front();
+    const auto trb_type = event_trb->bits.trb_type;
+    Trace(TraceEvent::kXHCIProcessEventBegin, trb_type);
     if (auto trb = TRBDynamicCast<TransferEventTRB>(event_trb)) {
       err = OnEvent(xhc, *trb);
     } else if (auto trb = TRBDynamicCast<PortStatusChangeEventTRB>(event_trb)) {
@@ -523,6 +526,7 @@ namespace usb::xhci {
       err = OnEvent(xhc, *trb);
     }
     xhc.PrimaryEventRing()->Pop();
+    Trace(TraceEvent::kXHCIProcessEventEnd, trb_type, err.Cause());
 
     return err;
   }
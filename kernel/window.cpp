@@ -1,5 +1,6 @@
 #include "window.hpp"
 #include "font.hpp"
+#include "object_pool.hpp"
 
 namespace {
     const int kCloseButtonWidth = 16;
@@ -29,10 +30,22 @@ namespace {
     }
 }  // namespace
 
-Window::Window(int width, int height, PixelFormat shadow_format) : width_{width}, height_{height} {
-    data_.resize(height);
-    for (int y = 0; y < height; ++y) data_[y].resize(width);
+namespace {
+    /** @brief allocate_shared が確保するブロックには Window に加えて制御ブロックが入る */
+    using WindowPool = BlockPool<sizeof(Window) + 64, alignof(std::max_align_t), 64>;
+    WindowPool window_pool;
+
+    WindowPool& GetWindowPool() {
+        return window_pool;
+    }
+}  // namespace
+
+std::shared_ptr<Window> MakeWindow(int width, int height, PixelFormat shadow_format) {
+    PoolAllocator<Window, WindowPool, GetWindowPool> alloc;
+    return std::allocate_shared<Window>(alloc, width, height, shadow_format);
+}
 
+Window::Window(int width, int height, PixelFormat shadow_format) : width_{width}, height_{height} {
     FrameBufferConfig config{};
     config.frame_buffer = nullptr;
     config.horizontal_resolution = width;
@@ -53,21 +66,69 @@ void Window::DrawTo(FrameBuffer& dst, Vector2D<int> pos, const Rectangle<int>& a
         return;
     }
 
-    const auto tc = transparent_color_.value();
-    auto& writer = dst.Writer();
-
-    for (int y = std::max(0, 0 - pos.y); y < std::min(Height(), writer.Height() - pos.y); ++y) {
-        for (int x = std::max(0, 0 - pos.x); x < std::min(Width(), writer.Width() - pos.x); ++x) {
-            const auto c = At({x, y});
-            if (c != tc) writer.Write(pos + Vector2D<int>{x, y}, c);
+    const auto& src_config = shadow_buffer_.Config();
+    const auto& dst_config = dst.Config();
+    if (src_config.pixel_format != dst_config.pixel_format) return;
+
+    const Rectangle<int> window_area{pos, Size()};
+    const Rectangle<int> dst_area{{0, 0}, {static_cast<int>(dst_config.horizontal_resolution),
+                                           static_cast<int>(dst_config.vertical_resolution)}};
+    const auto draw_area = area & window_area & dst_area;
+    if (IsEmpty(draw_area)) return;
+
+    UpdateOpaqueSpans();
+
+    // ウィンドウ座標系での描画範囲 [x_begin, x_end) × [y_begin, y_end)
+    const int x_begin = draw_area.pos.x - pos.x;
+    const int x_end = x_begin + draw_area.size.x;
+    const int y_begin = draw_area.pos.y - pos.y;
+    const int y_end = y_begin + draw_area.size.y;
+
+    const auto src_pixels = reinterpret_cast<const uint32_t*>(src_config.frame_buffer);
+    const auto dst_pixels = reinterpret_cast<uint32_t*>(dst_config.frame_buffer);
+
+    for (int y = y_begin; y < y_end; ++y) {
+        const auto src_row = src_pixels + src_config.pixels_per_scan_line * y;
+        const auto dst_row = dst_pixels + dst_config.pixels_per_scan_line * (pos.y + y) + pos.x;
+        for (auto i = row_span_index_[y]; i < row_span_index_[y + 1]; ++i) {
+            const int begin = std::max(opaque_spans_[i].begin, x_begin);
+            const int end = std::min(opaque_spans_[i].end, x_end);
+            if (begin < end) CopySpan32(dst_row + begin, src_row + begin, end - begin);
         }
     }
 }
 
 void Window::SetTransparentColor(std::optional<PixelColor> c) {
     transparent_color_ = c;
+    opaque_spans_dirty_ = true;
 }
 
+void Window::UpdateOpaqueSpans() {
+    if (!opaque_spans_dirty_ || !transparent_color_) return;
+
+    const auto& config = shadow_buffer_.Config();
+    const auto pixels = reinterpret_cast<const uint32_t*>(config.frame_buffer);
+    const auto tc = ToNativePixel(config.pixel_format, transparent_color_.value()) & kPixelColorMask;
+
+    opaque_spans_.clear();
+    row_span_index_.resize(Height() + 1);
+    for (int y = 0; y < Height(); ++y) {
+        row_span_index_[y] = opaque_spans_.size();
+        const auto row = pixels + config.pixels_per_scan_line * y;
+        int x = 0;
+        while (x < Width()) {
+            while (x < Width() && (row[x] & kPixelColorMask) == tc) ++x;
+            const int begin = x;
+            while (x < Width() && (row[x] & kPixelColorMask) != tc) ++x;
+            if (begin < x) opaque_spans_.push_back({begin, x});
+        }
+    }
+    row_span_index_[Height()] = opaque_spans_.size();
+    opaque_spans_dirty_ = false;
+}
+
+bool Window::IsOpaque() const { return !transparent_color_; }
+
 Window* Window::Writer() { return this; }
 
 int Window::Width() const { return width_; }
@@ -75,55 +136,71 @@ int Window::Height() const { return height_; }
 
 Vector2D<int> Window::Size() const { return {Width(), Height()}; }
 
-const PixelColor& Window::At(Vector2D<int> pos) const {
-    return data_[pos.y][pos.x];
+PixelColor Window::At(Vector2D<int> pos) const {
+    const auto& config = shadow_buffer_.Config();
+    const auto pixels = reinterpret_cast<const uint32_t*>(config.frame_buffer);
+    return FromNativePixel(config.pixel_format, pixels[config.pixels_per_scan_line * pos.y + pos.x]);
 }
 
 void Window::Write(Vector2D<int> pos, const PixelColor& c) {
-    data_[pos.y][pos.x] = c;
     shadow_buffer_.Writer().Write(pos, c);
+    opaque_spans_dirty_ = true;
+}
+
+const FrameBufferConfig* Window::DirectConfig() const {
+    // 呼び出し元はこの設定を通じて画素を書き換えうる
+    opaque_spans_dirty_ = true;
+    return &shadow_buffer_.Config();
 }
 
 void Window::Move(Vector2D<int> dst_pos, const Rectangle<int>& src) {
     shadow_buffer_.Move(dst_pos, src);
+    opaque_spans_dirty_ = true;
 }
 
-void DrawWindow(PixelWriter& writer, const char* title){
-    auto fill_rect = [&writer](Vector2D<int> pos, Vector2D<int> size, uint32_t c) {
-        FillRectangle(writer, pos, size, ToColor(c));
-    };
-
-    const auto win_w = writer.Width();
-    const auto win_h = writer.Height();
-
-    fill_rect({0, 0}, {win_w, 1}, 0xc6c6c6);                // up-side outer highlight      (grey)
-    fill_rect({1, 1}, {win_w - 2, 1}, 0xffffff);            // up-side inner highlight      (white)
-    fill_rect({0, 0}, {1, win_h}, 0xc6c6c6);                // left-side outer highlight    (grey)
-    fill_rect({1, 1}, {1, win_h - 2}, 0xffffff);            // left-side inner highlight    (white)
-    fill_rect({win_w - 2, 1}, {1, win_h - 2}, 0x848484);    // right-side inner shadow      (dark grey)
-    fill_rect({win_w - 1, 0}, {1, win_h}, 0x000000);        // right-side outer shadow      (black)
-    fill_rect({2, 2}, {win_w - 4, win_h - 4}, 0xc6c6c6);    // window plane                 (grey)
-    fill_rect({3, 3}, {win_w - 6, 18}, 0x000084);           // title bar                    (blue)
-    fill_rect({1, win_h - 2}, {win_w - 2, 1}, 0x848484);    // down-side inner shadow       (dark grey)
-    fill_rect({0, win_h - 1}, {win_w, 1}, 0x000000);        // down-side outer shadow       (black)
-
-    WriteString(writer, {24, 4}, title, ToColor(0xffffff));
-
-    for (int y = 0; y < kCloseButtonHeight; ++y) {
-        for (int x = 0; x < kCloseButtonWidth; ++x) {
-            PixelColor c = ToColor(0xffffff);
-            switch(close_button[y][x]){
-                case '0':
-                    c = ToColor(0x000000);  // black
-                    break;
-                case '$':
-                    c = ToColor(0x848484);  // dark grey
-                    break;
-                case ':':
-                    c = ToColor(0xc6c6c6);  // grey
-                    break;
+namespace {
+    template <typename Writer>
+    void DrawWindowImpl(Writer& writer, const char* title) {
+        auto fill_rect = [&writer](Vector2D<int> pos, Vector2D<int> size, uint32_t c) {
+            detail::FillRectangle(writer, pos, size, ToColor(c));
+        };
+
+        const auto win_w = writer.Width();
+        const auto win_h = writer.Height();
+
+        fill_rect({0, 0}, {win_w, 1}, 0xc6c6c6);                // up-side outer highlight      (grey)
+        fill_rect({1, 1}, {win_w - 2, 1}, 0xffffff);            // up-side inner highlight      (white)
+        fill_rect({0, 0}, {1, win_h}, 0xc6c6c6);                // left-side outer highlight    (grey)
+        fill_rect({1, 1}, {1, win_h - 2}, 0xffffff);            // left-side inner highlight    (white)
+        fill_rect({win_w - 2, 1}, {1, win_h - 2}, 0x848484);    // right-side inner shadow      (dark grey)
+        fill_rect({win_w - 1, 0}, {1, win_h}, 0x000000);        // right-side outer shadow      (black)
+        fill_rect({2, 2}, {win_w - 4, win_h - 4}, 0xc6c6c6);    // window plane                 (grey)
+        fill_rect({3, 3}, {win_w - 6, 18}, 0x000084);           // title bar                    (blue)
+        fill_rect({1, win_h - 2}, {win_w - 2, 1}, 0x848484);    // down-side inner shadow       (dark grey)
+        fill_rect({0, win_h - 1}, {win_w, 1}, 0x000000);        // down-side outer shadow       (black)
+
+        detail::WriteString(writer, {24, 4}, title, ToColor(0xffffff));
+
+        for (int y = 0; y < kCloseButtonHeight; ++y) {
+            for (int x = 0; x < kCloseButtonWidth; ++x) {
+                PixelColor c = ToColor(0xffffff);
+                switch(close_button[y][x]){
+                    case '0':
+                        c = ToColor(0x000000);  // black
+                        break;
+                    case '$':
+                        c = ToColor(0x848484);  // dark grey
+                        break;
+                    case ':':
+                        c = ToColor(0xc6c6c6);  // grey
+                        break;
+                }
+                writer.Write({win_w - 5 - kCloseButtonWidth + x, 5 + y}, c);
             }
-            writer.Write({win_w - 5 - kCloseButtonWidth + x, 5 + y}, c);
         }
     }
+}  // namespace
+
+void DrawWindow(PixelWriter& writer, const char* title){
+    VisitPixelWriter(writer, [title](auto& w) { DrawWindowImpl(w, title); });
 }
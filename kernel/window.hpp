@@ -1,5 +1,6 @@
 #pragma once
 
+#include <memory>
 #include <optional>
 #include <vector>
 
@@ -24,11 +25,13 @@ class Window : public PixelWriter {
     void DrawTo(FrameBuffer& dst, Vector2D<int> pos, const Rectangle<int>& area);
     /** @brief 透過色を設定する */
     void SetTransparentColor(std::optional<PixelColor> c);
+    /** @brief 透過色が設定されておらず，描画領域全体を塗りつぶすなら true */
+    bool IsOpaque() const;
     /** @brief PixelWriter のインタフェースである Writer() を提供 *this を返す */
     Window* Writer();
 
     /** @brief 指定した位置のピクセルを返す */
-    const PixelColor& At(Vector2D<int> pos) const;
+    PixelColor At(Vector2D<int> pos) const;
 
     /** @brief 平面描画領域の横幅をピクセル単位で返す */
     int Width() const override;
@@ -37,8 +40,10 @@ class Window : public PixelWriter {
     /** @brief 平面描画領域のサイズを返す */
     Vector2D<int> Size() const;
 
-    /** @brief シャドウバッファに転送しながら描画する */
+    /** @brief シャドウバッファに描画する */
     void Write(Vector2D<int> pos, const PixelColor& c) override;
+    /** @brief 描画関数がシャドウバッファへ直接書き込めるよう，その設定を返す */
+    const FrameBufferConfig* DirectConfig() const override;
 
     /**
      * @brief このウィンドウの平面描画領域内で、矩形領域を移動する
@@ -50,11 +55,37 @@ class Window : public PixelWriter {
     void Move(Vector2D<int> dst_pos, const Rectangle<int>& src);
 
   private:
+    /** @brief 1 行のうち透過色でないピクセルが連続する区間 [begin, end) */
+    struct OpaqueSpan {
+        int begin, end;
+    };
+
     int width_, height_;
-    std::vector<std::vector<PixelColor>> data_{};
     std::optional<PixelColor> transparent_color_{std::nullopt};
 
+    /** @brief ウィンドウの唯一の画素データ 描画先のピクセル形式で保持する */
     FrameBuffer shadow_buffer_{};
+
+    /**
+     * @brief 透過色が設定されているときに使う，行ごとの不透明区間の一覧
+     *
+     * y 行目の区間は opaque_spans_[row_span_index_[y]] から opaque_spans_[row_span_index_[y + 1]] の手前まで
+     * 内容が変更されうる操作のたびに opaque_spans_dirty_ を立て，次の DrawTo で作り直す
+     */
+    std::vector<OpaqueSpan> opaque_spans_{};
+    std::vector<size_t> row_span_index_{};
+    mutable bool opaque_spans_dirty_{true};
+
+    /** @brief 必要なら不透明区間の一覧を作り直す */
+    void UpdateOpaqueSpans();
 };
 
+/**
+ * @brief ウィンドウを生成する
+ *
+ * ウィンドウ本体と shared_ptr の制御ブロックは 1 つのブロックにまとめて
+ * ウィンドウ用のプールから確保する プールが一杯のときはヒープから確保する
+ */
+std::shared_ptr<Window> MakeWindow(int width, int height, PixelFormat shadow_format);
+
 void DrawWindow(PixelWriter& writer, const char* title);